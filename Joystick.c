@@ -22,18 +22,44 @@ these buttons for our use.
 #include "gamebotserial.h"
 #include "packetserial.h"
 #include "cmdqueue.h"
+#include "channel.h"
+#include "stream.h"
+#include "motion.h"
+#include "turbo.h"
+#include "macro.h"
+#include "timebase.h"
+
+// The queue and the serial buffers take at most half the RAM, the rest
+// is left for the other variables, LUFA and the stack.
+#if (CMDQUEUE_SIZE+2*SERIAL_RING_SIZE+SP2_MAX_FRAME_SIZE) > (RAM_SIZE/2)
+#error The command queue and serial buffers are too big for RAM_SIZE
+#endif
 
 // constants
 #define ECHO_TIMES 3
 #define LED_DURATION 50
 
 // global variables
+cmdqueue_element_t current_element; // unpacked from the queue
 cmdqueue_element_t *gpe=NULL;  // global pointer to element
+USB_JoystickReport_Input_t base_report; // the last command's report
+// The report sent to the host, with the channels merged in, is double
+// buffered. Report_Task builds a new one in the back buffer and then
+// flips report_front, so HID_Task only ever copies a whole report.
+USB_JoystickReport_Input_t report_buffer[2];
+uint16_t report_buffer_sequence[2]; // report_sequence of each buffer
+uint8_t report_front=0;
 uint8_t echo_count=0;  // how many times to send the same report
+uint8_t report_mode=GB_REPORT_ECHO;
+report_stats_t report_stats;
+uint16_t report_sequence=0; // counts changes of report
+uint32_t report_change_usec=0; // TimerMicros() when report changed
+uint32_t previous_change_usec=0; // and when the one before it did
+bool report_in_flight=false; // a report is in the IN bank
+uint16_t report_in_flight_sequence=0; // and which one
 
 // timers
-volatile uint32_t interrupt_count=0;
-volatile uint32_t cmd_elapsed_msec=0;
+uint32_t cmd_start_usec=0; // ScheduleMicros() when the current part of the command started
 volatile uint8_t led_ms = 0;                          // transmission LED countdown
 
 // yyy
@@ -64,6 +90,24 @@ int main(void)
 
         // Process the commands in the queue.
         CMDQueue_Task();
+#if GB_HAVE_CHANNELS
+        Channel_Task();
+#endif
+#if GB_HAVE_STREAM
+        Stream_Task();
+#endif
+#if GB_HAVE_MOTION
+        Motion_Task();
+#endif
+#if GB_HAVE_TURBO
+        Turbo_Task();
+#endif
+#if GB_HAVE_MACRO
+        // Write a macro to the EEPROM as it is ready.
+        Macro_Task();
+#endif
+        // Build the report from the command and the channels.
+        Report_Task();
     }
 }
 
@@ -81,11 +125,9 @@ void SetupHardware(void)
     LEDs_Init();
 
     // Initialize timer interrupt
-    TIMSK0 |= (1 << TOIE0);
+    TimebaseInit();
     //enable interrupts
     sei();
-    // set prescaler to 64 and start the timer
-    TCCR0B |= (1 << CS01) | (1 << CS00);
 
     // We can then initialize our hardware and peripherals, including the USB stack.
 
@@ -93,17 +135,15 @@ void SetupHardware(void)
     USB_Init();
 
     // Initialize serial port.
-    Serial_Init(9600, false);
+    Serial_Init(SERIAL_DEFAULT_BAUD, false);
+    // Receive in the background so no bytes are lost while the main
+    // loop is busy.
+    SerialInterruptInit();
 }
 
-ISR (TIMER0_OVF_vect) // timer0 overflow interrupt
+// Count down the LED, once a msec from the timer interrupt.
+void LEDTick(void)
 {
-    // add 6 to the register (our work around)
-    TCNT0 += 6;
-
-    interrupt_count++;
-    cmd_elapsed_msec++;
-
     // decrement LED counter
     if (led_ms != 0)
     {
@@ -134,6 +174,12 @@ void EVENT_USB_Device_ConfigurationChanged(void)
     ConfigSuccess &= Endpoint_ConfigureEndpoint(JOYSTICK_OUT_EPADDR, EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
     ConfigSuccess &= Endpoint_ConfigureEndpoint(JOYSTICK_IN_EPADDR, EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
 
+#if !defined(NO_SOF_EVENTS)
+    // Frames time the schedule if asked, and always measure the timer's
+    // drift.
+    USB_Device_EnableSOFEvents();
+#endif
+
     // We can read ConfigSuccess to indicate a success or failure at this point.
 }
 
@@ -172,45 +218,125 @@ void HID_Task(void)
         Endpoint_ClearOUT();
     }
 
-    // The report to send is at gpe.
-    // Send the report echo_count times.
-    if ( echo_count > 0 && gpe )
+    // We'll then move on to the IN endpoint.
+    Endpoint_SelectEndpoint(JOYSTICK_IN_EPADDR);
+    // We first check to see if the host is ready to accept data.
+    if (Endpoint_IsINReady())
     {
-        // We'll then move on to the IN endpoint.
-        Endpoint_SelectEndpoint(JOYSTICK_IN_EPADDR);
-        // We first check to see if the host is ready to accept data.
-        if (Endpoint_IsINReady())
+        // The bank is free again so the host took the last report.
+        if( report_in_flight )
         {
-            // Once populated, we can output this data to the host. We do this by first writing the data to the control stream.
-            if(Endpoint_Write_Stream_LE(&(gpe->i), sizeof(gpe->i), NULL) == ENDPOINT_RWSTREAM_NoError)
+            report_in_flight=false;
+            ReportDelivered(report_in_flight_sequence);
+        }
+
+        // Send the report echo_count times, or on every poll.
+        if ( GB_REPORT_EVERY_POLL == report_mode || echo_count > 0 )
+        {
+            // The report is much smaller than the endpoint bank so it
+            // always fits, copy the front buffer straight in.
+            uint8_t front=report_front;
+            const uint8_t *p=(const uint8_t *)&(report_buffer[front]);
+            for( uint8_t i=0; i < sizeof(USB_JoystickReport_Input_t); i++ )
+            {
+                Endpoint_Write_8(p[i]);
+            }
+            // We then send an IN packet on this endpoint.
+            Endpoint_ClearIN();
+            report_in_flight=true;
+            report_in_flight_sequence=report_buffer_sequence[front];
+            // decrement echo counter
+            if( echo_count > 0 )
             {
-                // We then send an IN packet on this endpoint.
-                Endpoint_ClearIN();
-                // decrement echo counter
                 echo_count--;
             }
         }
     }
 }
 
+// Note that report changed, for the delivery counts.
+void ReportChanged(void)
+{
+    report_sequence++;
+    report_stats.reports++;
+    report_stats.previous_count=report_stats.current_count;
+    report_stats.current_count=0;
+    previous_change_usec=report_change_usec;
+    report_change_usec=TimerMicros();
+}
+
+// The host took the report numbered sequence. Count it, and the first
+// time, how long after the change it took.
+void ReportDelivered(uint16_t sequence)
+{
+    uint8_t *pcount;
+    uint32_t change_usec;
+
+    if( sequence == report_sequence )
+    {
+        pcount=&(report_stats.current_count);
+        change_usec=report_change_usec;
+    }
+    else if( sequence == (uint16_t)(report_sequence-1) )
+    {
+        // It was in the bank when the report changed.
+        pcount=&(report_stats.previous_count);
+        change_usec=previous_change_usec;
+    }
+    else
+    {
+        return;
+    }
+
+    if( *pcount < 0xff )
+    {
+        (*pcount)++;
+    }
+    if( 1 == *pcount )
+    {
+        uint32_t first=TimerMicros()-change_usec;
+        if( first > 0xffff )
+        {
+            first=0xffff;
+        }
+        report_stats.delivered++;
+        report_stats.last_first_usec=first;
+        if( first > report_stats.max_first_usec )
+        {
+            report_stats.max_first_usec=first;
+        }
+        report_stats.sum_first_usec+=first;
+#if GB_HAVE_STREAM
+        StreamDelivered(sequence);
+#endif
+    }
+}
+
+// Start the counts over. The current and previous reports keep their
+// delivery counts so they aren't counted again as first deliveries.
+void ReportStatsReset(void)
+{
+    uint8_t current_count=report_stats.current_count;
+    uint8_t previous_count=report_stats.previous_count;
+
+    memset(&report_stats,0,sizeof(report_stats));
+    report_stats.current_count=current_count;
+    report_stats.previous_count=previous_count;
+}
+
 // Process data from serial port.
 // yyy
 void Serial_Task(void)
 {
-    // read all incoming bytes available
-    while (true)
+    // Incoming bytes are saved in the input ring by the
+    // receive interrupt.
+    if( SerialRingUsed(&sri) > 0 )
     {
-        // read next byte
-        int16_t byte = Serial_ReceiveByte();
-        if (byte < 0)
-            break;
-        // save the byte in input ring
-        SerialRingAdd(&sri,(uint8_t)byte);
-
         BlinkLED();
     }
     SerialPacketTask();
-    SerialOutRingTask(); // yyy
+    SerialOutRingTask();
+    SerialBaudTask();
 }
 
 void BlinkLED(void)
@@ -225,8 +351,45 @@ void CMDQueueClear_gpe(void)
     SetDefaultStateReport();
 }
 
+// The time current_element's part of d takes.
+uint32_t DurationMicros(uint16_t d)
+{
+    return ((uint32_t)d)*(current_element.fine?100:1000);
+}
+
+// Start current_element as if it had started at start_usec.
+void CMDQueueStart(uint32_t start_usec)
+{
+    gpe=&current_element;
+    echo_count=ECHO_TIMES;
+    cmd_start_usec=start_usec;
+}
+
+// How long the current part of the command has been running.
+uint32_t CmdElapsedMSec(void)
+{
+    return (ScheduleMicros()-cmd_start_usec)/1000;
+}
+
 void CMDQueue_Task(void)
 {
+    uint32_t now=TickNow();
+    uint32_t now_usec=ScheduleMicros();
+    uint32_t start_usec=now_usec;
+
+    // An element with a start time starts at that time, cutting short
+    // the current command if it's still running. Until then nothing
+    // after it starts. Timing it from its start time rather than now
+    // keeps its end on time too.
+    uint32_t at;
+    bool scheduled=CMDQueuePeekAt(&at);
+    if( scheduled && (int32_t)(now-at) >= 0 )
+    {
+        CMDQueuePop(&current_element);
+        CMDQueueStart(at*1000);
+        return;
+    }
+
     if( gpe )
     {
         // Continue or complete the current command.
@@ -239,10 +402,25 @@ void CMDQueue_Task(void)
         }
 #endif
 
-        uint32_t cem=cmd_elapsed_msec;
-        if( cem >= gpe->duration_msec )
+        if( (now_usec-cmd_start_usec) >= DurationMicros(gpe->duration_msec) )
         {
-            // The command is done.
+            if( gpe->release )
+            {
+                // The press is done, now send the release in the
+                // same element, timed from when the press should
+                // have ended.
+                cmd_start_usec+=DurationMicros(gpe->duration_msec);
+                uint16_t release_msec=gpe->release_msec;
+                bool fine=gpe->fine;
+                SetElementDefaultState(gpe);
+                gpe->duration_msec=release_msec;
+                gpe->fine=fine;
+                echo_count=ECHO_TIMES;
+                return;
+            }
+            // The command is done. One that follows straight on
+            // starts when this one should have ended.
+            start_usec=cmd_start_usec+DurationMicros(gpe->duration_msec);
             gpe=NULL;
             // Fall through to the next section.
         }
@@ -250,20 +428,78 @@ void CMDQueue_Task(void)
 
     if( ! gpe )
     {
-        // Start the next command, if any.
-        CMDQueuePop(&gpe);
-
-        if( gpe )
+        // Start the next command, if any. A playing macro goes ahead of
+        // the queue.
+#if GB_HAVE_MACRO
+        bool popped=MacroPop(&current_element);
+#else
+        bool popped=false;
+#endif
+        if( popped || ( ! scheduled && CMDQueuePop(&current_element) ) )
         {
             // There was a new command. Start it.
-            echo_count=ECHO_TIMES;
-            cmd_elapsed_msec=0;
+            CMDQueueStart(start_usec);
         }
     }
 }
 
+// The merge stage. Start from the current command's report, or the last
+// one when the queue is empty, and put each channel's held value over
+// it. A new report is sent ECHO_TIMES times like a new command, or on
+// every poll in GB_REPORT_EVERY_POLL. A new streamed state is always a
+// new report so it goes out on the next poll. Running stick motions and
+// turbo buttons go over everything.
+void Report_Task(void)
+{
+    if( gpe )
+    {
+        base_report=gpe->i;
+    }
+
+    // Build into the back buffer, the front may be being sent. While
+    // streaming the mailbox takes the command's place.
+    uint8_t back=report_front^1;
+    USB_JoystickReport_Input_t *pr=&(report_buffer[back]);
+    bool streamed=false;
+#if GB_HAVE_STREAM
+    if( GB_STREAM_OFF != stream_mode )
+    {
+        streamed=StreamTake(pr);
+    }
+    else
+#endif
+    {
+        *pr=base_report;
+    }
+#if GB_HAVE_CHANNELS
+    ChannelMerge(pr);
+#endif
+#if GB_HAVE_MOTION
+    MotionMerge(pr);
+#endif
+#if GB_HAVE_TURBO
+    TurboMerge(pr);
+#endif
+
+    if( streamed || 0 != memcmp(pr,&(report_buffer[report_front]),sizeof(*pr)) )
+    {
+        ReportChanged();
+#if GB_HAVE_STREAM
+        if( streamed )
+        {
+            StreamReported(report_sequence);
+        }
+#endif
+        report_buffer_sequence[back]=report_sequence;
+        // One byte store, the flip can't be seen half done.
+        report_front=back;
+        echo_count=ECHO_TIMES;
+    }
+}
+
 void SetDefaultStateReport(void)
 {
-    cmdqueue_element_t *pe=NULL;
-    CMDQueueAdd(&pe);
+    cmdqueue_element_t e;
+    SetElementDefaultState(&e);
+    CMDQueueAdd(&e);
 }
@@ -110,9 +110,23 @@ typedef struct {
 } USB_JoystickReport_Output_t;
 
 // Joystick.c
+extern USB_JoystickReport_Input_t base_report;
 extern uint8_t echo_count;
+extern uint8_t report_mode;
+
+// Delivery of reports to the host, counted when the host takes them.
+typedef struct report_stats_t {
+    uint16_t reports; // changes of report
+    uint16_t delivered; // of those the host got at least once
+    uint8_t current_count; // deliveries of the current report
+    uint8_t previous_count; // deliveries of the one before it
+    uint16_t last_first_usec; // change to first delivery, last report
+    uint16_t max_first_usec; // and the longest
+    uint32_t sum_first_usec; // and all of them, for the average
+} report_stats_t;
+extern report_stats_t report_stats;
 extern volatile uint32_t interrupt_count;
-extern volatile uint32_t cmd_elapsed_msec;
+extern uint32_t cmd_start_usec;
 
 // Function Prototypes
 // Setup all necessary hardware, including USB initialization.
@@ -124,6 +138,7 @@ void EVENT_USB_Device_Connect(void);
 void EVENT_USB_Device_Disconnect(void);
 void EVENT_USB_Device_ConfigurationChanged(void);
 void EVENT_USB_Device_ControlRequest(void);
+void EVENT_USB_Device_StartOfFrame(void);
 // Reset report to default.
 void ResetReport(void);
 // Prepare the next report for the host.
@@ -132,10 +147,18 @@ void GetNextReport(USB_JoystickReport_Input_t* const ReportData);
 void Serial_Task(void);
 // LED control
 void BlinkLED(void);
+void LEDTick(void);
 
 // Joystick.c
 void CMDQueueClear_gpe(void);
+uint32_t DurationMicros(uint16_t d);
+void CMDQueueStart(uint32_t start_usec);
+uint32_t CmdElapsedMSec(void);
 void CMDQueue_Task(void);
+void Report_Task(void);
+void ReportChanged(void);
+void ReportDelivered(uint16_t sequence);
+void ReportStatsReset(void);
 void SetDefaultStateReport(void);
 
 #endif /* _JOYSTICK_H_ */
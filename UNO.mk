@@ -19,6 +19,7 @@ REAL_BOARD   = UNO
 BOARD        = UNO
 MCU          = atmega16u2
 MEM_SIZE     = 400
+RAM_SIZE     = 512
 LEDMASK_TX   = LEDS_LED2
 LEDMASK_RX   = LEDS_LED1
 ARCH         = AVR8
@@ -28,7 +29,7 @@ OPTIMIZATION = s
 TARGET       = ./$(REAL_BOARD)/$(REAL_BOARD)
 SRC          = Joystick.c Descriptors.c $(LUFA_SRC_USB)
 LUFA_PATH    = ./lufa/LUFA
-CC_FLAGS     = -DUSE_LUFA_CONFIG_HEADER -DMEM_SIZE=$(MEM_SIZE) -DBOARD=$(BOARD) -DLEDMASK_TX=$(LEDMASK_TX) -DLEDMASK_RX=$(LEDMASK_RX) -IConfig/ 
+CC_FLAGS     = -DUSE_LUFA_CONFIG_HEADER -DMEM_SIZE=$(MEM_SIZE) -DRAM_SIZE=$(RAM_SIZE) -DBOARD=$(BOARD) -DLEDMASK_TX=$(LEDMASK_TX) -DLEDMASK_RX=$(LEDMASK_RX) -IConfig/ 
 LD_FLAGS     =
 
 $(shell mkdir ./$(REAL_BOARD))
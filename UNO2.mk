@@ -14,6 +14,7 @@
 # Set the MCU accordingly to your device (e.g. at90usb1286 for a Teensy 2.0++, or atmega16u2 for an Arduino UNO R3)
 BOARD        = UNO
 MCU          = atmega16u2
+RAM_SIZE     = 512
 ARCH         = AVR8
 F_CPU        = 16000000
 F_USB        = $(F_CPU)
@@ -21,7 +22,7 @@ OPTIMIZATION = s
 TARGET       = Joystick
 SRC          = $(TARGET).c Descriptors.c $(LUFA_SRC_USB)
 LUFA_PATH    = ./lufa/LUFA
-CC_FLAGS     = -DUSE_LUFA_CONFIG_HEADER -IConfig/ 
+CC_FLAGS     = -DUSE_LUFA_CONFIG_HEADER -DRAM_SIZE=$(RAM_SIZE) -IConfig/ 
 LD_FLAGS     =
 
 # Default target
@@ -0,0 +1,142 @@
+/*
+Copyright 2021 by angry-kitten
+Per channel timelines for gamebot-serial.
+*/
+
+#include <LUFA/Drivers/USB/USB.h>
+#include <LUFA/Platform/Platform.h>
+
+#include "gamebotserial.h"
+#include "channel.h"
+#include "timebase.h"
+
+#if GB_HAVE_CHANNELS
+
+channel_t channels[CHANNEL_COUNT];
+
+void ChannelReset(void)
+{
+    uint8_t c;
+    for(c=0;c<CHANNEL_COUNT;c++)
+    {
+        channels[c].head=0;
+        channels[c].tail=0;
+        channels[c].running=false;
+        channels[c].releasing=false;
+    }
+}
+
+uint8_t ChannelFree(uint8_t c)
+{
+    channel_t *pc=&(channels[c]);
+    return CHANNEL_QUEUE_SIZE-(uint8_t)(pc->head-pc->tail);
+}
+
+// Add a copy of the element at pe to the end of channel c. Returns
+// false, with nothing added, if the channel is full.
+bool ChannelAdd(uint8_t c, channel_element_t *pe)
+{
+    if( 0 == ChannelFree(c) )
+    {
+        return false;
+    }
+
+    channel_t *pc=&(channels[c]);
+    pc->ring[pc->head&CHANNEL_QUEUE_MASK]=*pe;
+    pc->head++;
+
+    return true;
+}
+
+// Move channel c along its timeline to now. Each part starts when the
+// one before it ended, not when this noticed, so the timing doesn't
+// drift with the main loop.
+void ChannelAdvance(channel_t *pc, uint32_t now)
+{
+    while( pc->head != pc->tail )
+    {
+        channel_element_t *pe=&(pc->ring[pc->tail&CHANNEL_QUEUE_MASK]);
+
+        if( ! pc->running )
+        {
+            // Start it now, the channel was idle.
+            pc->running=true;
+            pc->releasing=false;
+            pc->start_msec=now;
+        }
+
+        uint32_t elapsed=now-pc->start_msec;
+        if( ! pc->releasing )
+        {
+            if( elapsed < pe->duration_msec )
+            {
+                return;
+            }
+            pc->start_msec+=pe->duration_msec;
+            elapsed-=pe->duration_msec;
+            if( pe->release_msec > 0 )
+            {
+                pc->releasing=true;
+            }
+        }
+        if( pc->releasing )
+        {
+            if( elapsed < pe->release_msec )
+            {
+                return;
+            }
+            pc->start_msec+=pe->release_msec;
+            pc->releasing=false;
+        }
+
+        // This element is done, the next one starts where it ended.
+        pc->tail++;
+    }
+
+    pc->running=false;
+}
+
+void Channel_Task(void)
+{
+    uint32_t now=TickNow();
+
+    uint8_t c;
+    for(c=0;c<CHANNEL_COUNT;c++)
+    {
+        ChannelAdvance(&(channels[c]),now);
+    }
+}
+
+// Replace the parts of the report at pr that a channel is holding.
+void ChannelMerge(USB_JoystickReport_Input_t *pr)
+{
+    uint8_t c;
+    for(c=0;c<CHANNEL_COUNT;c++)
+    {
+        channel_t *pc=&(channels[c]);
+        if( ! pc->running || pc->releasing )
+        {
+            continue;
+        }
+        uint16_t v=pc->ring[pc->tail&CHANNEL_QUEUE_MASK].value;
+        switch(c)
+        {
+            case CHANNEL_BUTTONS:
+                pr->Button=v;
+                break;
+            case CHANNEL_HAT:
+                pr->HAT=0xff&v;
+                break;
+            case CHANNEL_LEFT:
+                pr->LX=0xff&(v>>8);
+                pr->LY=0xff&v;
+                break;
+            case CHANNEL_RIGHT:
+                pr->RX=0xff&(v>>8);
+                pr->RY=0xff&v;
+                break;
+        }
+    }
+}
+
+#endif /* GB_HAVE_CHANNELS */
@@ -0,0 +1,57 @@
+/*
+Copyright 2021 by angry-kitten
+Per channel timelines for gamebot-serial.
+*/
+
+#ifndef _CHANNEL_H
+#define _CHANNEL_H
+
+#include "Joystick.h"
+#include "cmdqueue.h"
+
+// Each channel has its own timeline of elements that run alongside the
+// command queue. While a channel element is held its value replaces that
+// part of the command queue's report.
+#define CHANNEL_BUTTONS         (0) // Button
+#define CHANNEL_HAT             (1) // HAT, value in the low byte
+#define CHANNEL_LEFT            (2) // LX in the high byte, LY in the low
+#define CHANNEL_RIGHT           (3) // RX in the high byte, RY in the low
+#define CHANNEL_COUNT           (4)
+
+#if RAM_SIZE >= 8192
+#define CHANNEL_QUEUE_SIZE      (32)
+#elif RAM_SIZE >= 2560
+#define CHANNEL_QUEUE_SIZE      (8)
+#else
+#define CHANNEL_QUEUE_SIZE      (2)
+#endif
+#define CHANNEL_QUEUE_MASK      (CHANNEL_QUEUE_SIZE-1)
+#if (CHANNEL_QUEUE_SIZE & CHANNEL_QUEUE_MASK) || (CHANNEL_QUEUE_SIZE > 128)
+#error CHANNEL_QUEUE_SIZE must be a power of two no larger than 128
+#endif
+
+typedef struct channel_element_t {
+    uint16_t value;
+    uint16_t duration_msec; // held this long
+    uint16_t release_msec; // then released this long, 0 for none
+} channel_element_t;
+
+typedef struct channel_t {
+    uint8_t head; // incremented as elements added
+    uint8_t tail; // incremented as elements finish
+    bool running; // the element at tail has started
+    bool releasing; // and is in its release
+    uint32_t start_msec; // interrupt_count when the current part started
+    channel_element_t ring[CHANNEL_QUEUE_SIZE];
+} channel_t;
+
+extern channel_t channels[CHANNEL_COUNT];
+
+// channel.c
+void ChannelReset(void);
+uint8_t ChannelFree(uint8_t c);
+bool ChannelAdd(uint8_t c, channel_element_t *pe);
+void Channel_Task(void);
+void ChannelMerge(USB_JoystickReport_Input_t *pr);
+
+#endif /* _CHANNEL_H */
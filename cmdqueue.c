@@ -19,14 +19,29 @@ void CMDQueueReset(void)
     cmdq.tail=0;
 }
 
-uint8_t CMDQueueUsed(void)
+uint16_t CMDQueueUsed(void)
 {
     return cmdq.count;
 }
 
+uint16_t CMDQueueUsedBytes(void)
+{
+    return cmdq.head-cmdq.tail;
+}
+
+uint16_t CMDQueueFreeBytes(void)
+{
+    return CMDQUEUE_SIZE-CMDQueueUsedBytes();
+}
+
+// The free space as the host sees it, in bytes, at most 255.
 uint8_t CMDQueueFree(void)
 {
-    uint8_t f=(CMDQUEUE_SIZE-1)-(cmdq.count);
+    uint16_t f=CMDQueueFreeBytes();
+    if( f > 0xff )
+    {
+        f=0xff;
+    }
     return f;
 }
 
@@ -42,38 +57,303 @@ void SetElementDefaultState(cmdqueue_element_t *pe)
     pe->i.RY=STICK_CENTER;
 }
 
-// Add an item to the queue by returning a pointer to the next
-// available element. It's a kinda reversed. Add it first and
-// fill it in second.
-void CMDQueueAdd(cmdqueue_element_t **ppe)
+uint8_t CMDQueueElementMask(cmdqueue_element_t *pe)
 {
-    *ppe=NULL;
+    uint8_t mask=0;
 
-    uint8_t f=CMDQueueFree();
-    if( 0 == f )
+    if( 0 != pe->i.Button )
     {
-        return;
+        mask|=CMDQ_FIELD_BUTTON;
+    }
+    if( HAT_CENTER != pe->i.HAT )
+    {
+        mask|=CMDQ_FIELD_HAT;
+    }
+    if( STICK_CENTER != pe->i.LX )
+    {
+        mask|=CMDQ_FIELD_LX;
+    }
+    if( STICK_CENTER != pe->i.LY )
+    {
+        mask|=CMDQ_FIELD_LY;
+    }
+    if( STICK_CENTER != pe->i.RX )
+    {
+        mask|=CMDQ_FIELD_RX;
+    }
+    if( STICK_CENTER != pe->i.RY )
+    {
+        mask|=CMDQ_FIELD_RY;
+    }
+    if( 0 != pe->duration_msec )
+    {
+        mask|=CMDQ_FIELD_DURATION;
+    }
+    if( pe->release )
+    {
+        mask|=CMDQ_FIELD_RELEASE;
+    }
+    if( CMDQ_FIELD_EXTENDED == mask )
+    {
+        // Keep the zero mask for extended elements.
+        mask=CMDQ_FIELD_DURATION;
+    }
+
+    return mask;
+}
+
+// Return the bytes pe takes in the queue.
+uint8_t CMDQueueElementSize(cmdqueue_element_t *pe)
+{
+    uint8_t mask=CMDQueueElementMask(pe);
+    uint8_t size=1;
+
+    if( pe->at || pe->fine )
+    {
+        size+=1+1;
+    }
+    if( pe->at )
+    {
+        size+=4;
+    }
+    if( mask & CMDQ_FIELD_DURATION )
+    {
+        size+=2;
+    }
+    if( mask & CMDQ_FIELD_RELEASE )
+    {
+        size+=(pe->release_msec < 0x80)?1:2;
+    }
+    if( mask & CMDQ_FIELD_BUTTON )
+    {
+        size+=2;
+    }
+    if( mask & CMDQ_FIELD_HAT )
+    {
+        size++;
+    }
+    if( mask & CMDQ_FIELD_LX )
+    {
+        size++;
+    }
+    if( mask & CMDQ_FIELD_LY )
+    {
+        size++;
+    }
+    if( mask & CMDQ_FIELD_RX )
+    {
+        size++;
+    }
+    if( mask & CMDQ_FIELD_RY )
+    {
+        size++;
+    }
+
+    return size;
+}
+
+void CMDQueuePut(uint8_t b)
+{
+    cmdq.ring[cmdq.head&CMDQUEUE_MASK]=b;
+    cmdq.head++;
+}
+
+uint8_t CMDQueueGet(void)
+{
+    uint8_t b=cmdq.ring[cmdq.tail&CMDQUEUE_MASK];
+    cmdq.tail++;
+    return b;
+}
+
+// Pack the element at pe, one byte at a time to put.
+void CMDQueuePack(cmdqueue_element_t *pe, cmdqueue_put_t put)
+{
+    if( pe->at || pe->fine )
+    {
+        put(CMDQ_FIELD_EXTENDED);
+        put((pe->at?CMDQ_EXT_AT:0)|(pe->fine?CMDQ_EXT_FINE:0));
+    }
+    if( pe->at )
+    {
+        put(0xff&(pe->at_tick>>24));
+        put(0xff&(pe->at_tick>>16));
+        put(0xff&(pe->at_tick>>8));
+        put(0xff&pe->at_tick);
     }
-    
-    *ppe=&(cmdq.ring[cmdq.head]);
-    cmdq.head=(cmdq.head+1)%CMDQUEUE_SIZE;
-    cmdq.count++;
 
-    SetElementDefaultState(*ppe);
+    uint8_t mask=CMDQueueElementMask(pe);
+    put(mask);
+    if( mask & CMDQ_FIELD_DURATION )
+    {
+        put(0xff&(pe->duration_msec>>8));
+        put(0xff&pe->duration_msec);
+    }
+    if( mask & CMDQ_FIELD_RELEASE )
+    {
+        if( pe->release_msec < 0x80 )
+        {
+            put(pe->release_msec);
+        }
+        else
+        {
+            uint16_t r=pe->release_msec;
+            if( r > CMDQ_RELEASE_MAX_MSEC )
+            {
+                r=CMDQ_RELEASE_MAX_MSEC;
+            }
+            r|=CMDQ_RELEASE_LONG;
+            put(0xff&(r>>8));
+            put(0xff&r);
+        }
+    }
+    if( mask & CMDQ_FIELD_BUTTON )
+    {
+        put(0xff&(pe->i.Button>>8));
+        put(0xff&pe->i.Button);
+    }
+    if( mask & CMDQ_FIELD_HAT )
+    {
+        put(pe->i.HAT);
+    }
+    if( mask & CMDQ_FIELD_LX )
+    {
+        put(pe->i.LX);
+    }
+    if( mask & CMDQ_FIELD_LY )
+    {
+        put(pe->i.LY);
+    }
+    if( mask & CMDQ_FIELD_RX )
+    {
+        put(pe->i.RX);
+    }
+    if( mask & CMDQ_FIELD_RY )
+    {
+        put(pe->i.RY);
+    }
+}
+
+// Unpack an element into pe, one byte at a time from get, filling in the
+// fields that weren't stored with their default state.
+void CMDQueueUnpack(cmdqueue_element_t *pe, cmdqueue_get_t get)
+{
+    SetElementDefaultState(pe);
+
+    uint8_t mask=get();
+    if( CMDQ_FIELD_EXTENDED == mask )
+    {
+        uint8_t ext=get();
+        if( ext & CMDQ_EXT_AT )
+        {
+            pe->at=true;
+            pe->at_tick=((uint32_t)get())<<24;
+            pe->at_tick|=((uint32_t)get())<<16;
+            pe->at_tick|=((uint32_t)get())<<8;
+            pe->at_tick|=get();
+        }
+        pe->fine=(0 != (ext & CMDQ_EXT_FINE));
+        mask=get();
+    }
+    if( mask & CMDQ_FIELD_DURATION )
+    {
+        pe->duration_msec=get()<<8;
+        pe->duration_msec|=get();
+    }
+    if( mask & CMDQ_FIELD_RELEASE )
+    {
+        pe->release=true;
+        pe->release_msec=get();
+        if( pe->release_msec & 0x80 )
+        {
+            pe->release_msec=((pe->release_msec<<8)|get())&CMDQ_RELEASE_MAX_MSEC;
+        }
+    }
+    if( mask & CMDQ_FIELD_BUTTON )
+    {
+        pe->i.Button=get()<<8;
+        pe->i.Button|=get();
+    }
+    if( mask & CMDQ_FIELD_HAT )
+    {
+        pe->i.HAT=get();
+    }
+    if( mask & CMDQ_FIELD_LX )
+    {
+        pe->i.LX=get();
+    }
+    if( mask & CMDQ_FIELD_LY )
+    {
+        pe->i.LY=get();
+    }
+    if( mask & CMDQ_FIELD_RX )
+    {
+        pe->i.RX=get();
+    }
+    if( mask & CMDQ_FIELD_RY )
+    {
+        pe->i.RY=get();
+    }
 }
 
-// Return a pointer to the popped element.
-void CMDQueuePop(cmdqueue_element_t **ppe)
+// Pack a copy of the element at pe into the queue. Returns false, with
+// nothing added, if there isn't room.
+bool CMDQueueAdd(cmdqueue_element_t *pe)
 {
-    *ppe=NULL;
+    if( CMDQueueElementSize(pe) > CMDQueueFreeBytes() )
+    {
+        return false;
+    }
+
+    CMDQueuePack(pe,CMDQueuePut);
+    cmdq.count++;
+
+    return true;
+}
 
-    uint8_t u=CMDQueueUsed();
-    if( 0 == u )
+// Unpack the oldest element into pe. Returns false if the queue is
+// empty.
+bool CMDQueuePop(cmdqueue_element_t *pe)
+{
+    if( 0 == CMDQueueUsed() )
     {
-        return;
+        return false;
     }
-    *ppe=&(cmdq.ring[cmdq.tail]);
-    cmdq.tail=(cmdq.tail+1)%CMDQUEUE_SIZE;
+
+    CMDQueueUnpack(pe,CMDQueueGet);
     cmdq.count--;
+
+    return true;
 }
 
+// If the oldest element starts at an absolute time put the time in pat
+// and return true, leaving the element in the queue.
+bool CMDQueuePeekAt(uint32_t *pat)
+{
+    if( 0 == CMDQueueUsed() )
+    {
+        return false;
+    }
+
+    uint16_t t=cmdq.tail;
+    if( CMDQ_FIELD_EXTENDED != cmdq.ring[t&CMDQUEUE_MASK] )
+    {
+        return false;
+    }
+    t++;
+    if( ! (cmdq.ring[t&CMDQUEUE_MASK] & CMDQ_EXT_AT) )
+    {
+        return false;
+    }
+    t++;
+
+    uint32_t at=0;
+    uint8_t n;
+    for(n=0;n<4;n++)
+    {
+        at=(at<<8)|cmdq.ring[t&CMDQUEUE_MASK];
+        t++;
+    }
+    *pat=at;
+
+    return true;
+}
@@ -7,29 +7,88 @@ Command queue gamebot-serial.
 #define _CMDQUEUE_H
 
 #include "Joystick.h"
+#include "gamebotserial.h"
 
-#define CMDQUEUE_SIZE           (8)
+// The queue size in bytes comes from the board's RAM_SIZE.
+#if RAM_SIZE >= 8192
+#define CMDQUEUE_SIZE           (1024)
+#elif RAM_SIZE >= 2560
+#define CMDQUEUE_SIZE           (256)
+#else
+#define CMDQUEUE_SIZE           (64)
+#endif
+#define CMDQUEUE_MASK           (CMDQUEUE_SIZE-1)
+#if (CMDQUEUE_SIZE & CMDQUEUE_MASK)
+#error CMDQUEUE_SIZE must be a power of two
+#endif
 #define DEFAULT_BUTTON_PRESS_DURATION       (55)  // msec
 
 typedef struct cmdqueue_element_t {
     USB_JoystickReport_Input_t i; // input to the host
-    uint16_t duration_msec;
+    uint16_t duration_msec; // in 100 usec units when fine
+    // After duration_msec the element turns into the default state for
+    // release_msec, so a whole press takes one element.
+    bool release;
+    uint16_t release_msec;
+    // Start at the absolute time at_tick, in interrupt_count ticks,
+    // instead of after the element before it.
+    bool at;
+    uint32_t at_tick;
+    // duration_msec and release_msec are in 100 usec units.
+    bool fine;
 } cmdqueue_element_t;
 
+// Elements are packed in the queue as a field mask, then the duration
+// if it isn't zero, then only the report fields that differ from the
+// default state, in report order. A release is a single byte.
+#define CMDQ_FIELD_BUTTON       (0x01) // two bytes, MSB-first
+#define CMDQ_FIELD_HAT          (0x02)
+#define CMDQ_FIELD_LX           (0x04)
+#define CMDQ_FIELD_LY           (0x08)
+#define CMDQ_FIELD_RX           (0x10)
+#define CMDQ_FIELD_RY           (0x20)
+#define CMDQ_FIELD_DURATION     (0x40) // two bytes, MSB-first
+#define CMDQ_FIELD_RELEASE      (0x80) // release gap, one or two bytes
+// A release gap below 0x80 is one byte, otherwise two bytes MSB-first
+// with the top bit set.
+#define CMDQ_RELEASE_LONG       (0x8000)
+#define CMDQ_RELEASE_MAX_MSEC   (0x7fff)
+// A zero mask starts an extended element. It's followed by a byte of
+// extension flags, their fields, then the usual mask and fields. An
+// element that would have a zero mask stores a zero duration instead.
+#define CMDQ_FIELD_EXTENDED     (0x00)
+#define CMDQ_EXT_AT             (0x01) // four bytes, MSB-first
+#define CMDQ_EXT_FINE           (0x02) // no bytes, durations in 100 usec
+// extended, flags, at, mask, duration, release, button, hat, sticks
+#define CMDQUEUE_ELEMENT_MAX_SIZE   (1+1+4+1+2+2+2+1+4)
+// Changed whenever the packing above changes. Macros are kept in the
+// EEPROM packed, with this in their header.
+#define CMDQUEUE_PACK_VERSION       (1)
+
 typedef struct cmdqueue_t {
-    uint8_t head; // incremented as items added
-    uint8_t tail; // incremented as items removed
-    uint8_t count; // number of items present
-    cmdqueue_element_t ring[CMDQUEUE_SIZE];
+    uint16_t head; // incremented as bytes added
+    uint16_t tail; // incremented as bytes removed
+    uint16_t count; // number of elements present
+    uint8_t ring[CMDQUEUE_SIZE];
 } cmdqueue_t;
 
 extern cmdqueue_t cmdq;
 
+// Where elements are packed to and unpacked from a byte at a time.
+typedef void (*cmdqueue_put_t)(uint8_t b);
+typedef uint8_t (*cmdqueue_get_t)(void);
+
 // cmdqueue.c
 void CMDQueueReset(void);
+uint16_t CMDQueueFreeBytes(void);
 uint8_t CMDQueueFree(void);
-void CMDQueueAdd(cmdqueue_element_t **ppe);
-void CMDQueuePop(cmdqueue_element_t **ppe);
+void SetElementDefaultState(cmdqueue_element_t *pe);
+uint8_t CMDQueueElementSize(cmdqueue_element_t *pe);
+void CMDQueuePack(cmdqueue_element_t *pe, cmdqueue_put_t put);
+void CMDQueueUnpack(cmdqueue_element_t *pe, cmdqueue_get_t get);
+bool CMDQueueAdd(cmdqueue_element_t *pe);
+bool CMDQueuePop(cmdqueue_element_t *pe);
+bool CMDQueuePeekAt(uint32_t *pat);
 
 #endif /* _CMDQUEUE_H */
 
@@ -227,3 +227,44 @@ crc F_CRC_CalculaCheckSum(uint8_t const AF_Datos[], uint16_t VF_nBytes)
 
 #endif
 
+/*********************************************************************
+ *
+ * Function:    F_CRC_ActualizaByte()
+ *
+ * Description: Add one byte to a running CRC. Start with INITIAL_VALUE
+ *              and finish with F_CRC_Finaliza().
+ * Descripcion: Agrega un byte a un CRC en curso. Empieza con
+ *              INITIAL_VALUE y termina con F_CRC_Finaliza().
+ *
+ *********************************************************************/
+crc F_CRC_ActualizaByte(crc VF_CRCValue, uint8_t VF_Dato)
+{
+    #if (CALCULATE_LOOKUPTABLE == TRUE)
+        #define F_CRC_ValorDeTabla(_POS)    A_crcLookupTable[(_POS)]
+    #else
+        #define F_CRC_ValorDeTabla(_POS)    F_CRC_ObtenValorDeTabla(_POS)
+    #endif
+
+    #if (REVERSED_DATA == TRUE)
+        return (VF_CRCValue >> 8) ^ F_CRC_ValorDeTabla(((uint8_t)(VF_CRCValue & 0xFF)) ^ VF_Dato);
+    #else
+        return (VF_CRCValue << 8) ^ F_CRC_ValorDeTabla(((uint8_t)((VF_CRCValue >> (WIDTH - 8)) & 0xFF)) ^ VF_Dato);
+    #endif
+}
+
+/*********************************************************************
+ *
+ * Function:    F_CRC_Finaliza()
+ *
+ * Description: Finish a CRC built with F_CRC_ActualizaByte().
+ * Descripcion: Termina un CRC calculado con F_CRC_ActualizaByte().
+ *
+ *********************************************************************/
+crc F_CRC_Finaliza(crc VF_CRCValue)
+{
+    #if (REVERSED_OUT == FALSE)
+        return (VF_CRCValue ^ FINAL_XOR_VALUE);
+    #else
+        return (~VF_CRCValue ^ FINAL_XOR_VALUE);
+    #endif
+}
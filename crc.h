@@ -216,6 +216,8 @@ typedef uint64_t crc;
     void F_CRC_InicializaTabla(void);
 #endif
 crc F_CRC_CalculaCheckSum(uint8_t const AF_Datos[], uint16_t VF_nBytes);
+crc F_CRC_ActualizaByte(crc VF_CRCValue, uint8_t VF_Dato);
+crc F_CRC_Finaliza(crc VF_CRCValue);
 
 
 
@@ -0,0 +1,18 @@
+/*
+Copyright 2021 by angry-kitten
+CRC lookup tables for gamebot-serial.
+*/
+
+#ifndef _CRCTABLE_H
+#define _CRCTABLE_H
+
+#include <stdint.h>
+
+#define CRC8_INITIAL_VALUE      (0x00)
+#define CRC16_INITIAL_VALUE     (0xffff)
+
+// crctable.c
+uint8_t CRC8Update(uint8_t c, uint8_t b);
+uint16_t CRC16Update(uint16_t c, uint8_t b);
+
+#endif /* _CRCTABLE_H */
@@ -14,6 +14,34 @@ General header for gamebot-serial.
 
 #define GB_VERSION_STRING   GBSTR(GB_MAJOR_VERSION) "." GBSTR(GB_MINOR_VERSION)
 
+// The board's RAM, set in its .mk file. Older makefiles only set
+// MEM_SIZE. The buffers are sized from it, and the features below are
+// left out of boards without room for them. Their requests get an error
+// reply there.
+#ifndef RAM_SIZE
+#if MEM_SIZE >= 900
+#define RAM_SIZE                (2560)
+#else
+#define RAM_SIZE                (512)
+#endif
+#endif
+#if RAM_SIZE < 512
+#error RAM_SIZE is smaller than the smallest board, an atmega16u2
+#endif
+#if RAM_SIZE >= 2560
+#define GB_HAVE_CHANNELS        (1) // GBPCMD_REQ_CHANNEL
+#define GB_HAVE_STREAM          (1) // GBPCMD_REQ_STREAM_MODE and the rest
+#define GB_HAVE_MOTION          (1) // GBPCMD_REQ_MOTION
+#define GB_HAVE_TURBO           (1) // GBPCMD_REQ_TURBO
+#define GB_HAVE_MACRO           (1) // GBPCMD_REQ_MACRO_WRITE and the rest
+#else
+#define GB_HAVE_CHANNELS        (0)
+#define GB_HAVE_STREAM          (0)
+#define GB_HAVE_MOTION          (0)
+#define GB_HAVE_TURBO           (0)
+#define GB_HAVE_MACRO           (0)
+#endif
+
 // These are the prefixes for the commands in the data
 // part of the packets.
 #define GBPCMD_REQ_TEST                 'T'
@@ -35,6 +63,32 @@ General header for gamebot-serial.
 #define GBPCMD_REQ_CLEAR_STATE          'C'
 #define GBPCMD_REQ_PAUSE_MSEC           'P'
 #define GBPCMD_REQ_REPORT_PENDING       'p'
+#define GBPCMD_REQ_SERIAL_ERRORS        'e'
+#define GBPCMD_REQ_SET_BAUD             'N'
+#define GBPCMD_REQ_SET_CHECKSUM         'K'
+#define GBPCMD_REQ_SEQUENCE             '#' // wraps another request
+#define GBPCMD_REQ_ONCE                 '!' // wraps a request with an id
+#define GBPCMD_REQ_BATCH                'X'
+#define GBPCMD_REQ_SET_CREDITS          'F'
+#define GBPCMD_REQ_CAPACITY             'c'
+#define GBPCMD_REQ_QUEUE_FREE           'f'
+#define GBPCMD_REQ_CHANNEL              'V'
+#define GBPCMD_REQ_AT                   'A'
+#define GBPCMD_REQ_TIME                 't'
+#define GBPCMD_REQ_SET_TICK             'u'
+#define GBPCMD_REQ_SET_UNITS            'm'
+#define GBPCMD_REQ_SET_REPORT_MODE      'i'
+#define GBPCMD_REQ_REPORT_STATS         'I'
+#define GBPCMD_REQ_STREAM_MODE          'W'
+#define GBPCMD_REQ_STREAM               'w'
+#define GBPCMD_REQ_STREAM_STATS         'j'
+#define GBPCMD_REQ_STREAM_TIMED         'J'
+#define GBPCMD_REQ_JITTER_STATS         'k'
+#define GBPCMD_REQ_MOTION               'G'
+#define GBPCMD_REQ_TURBO                'z'
+#define GBPCMD_REQ_MACRO_WRITE          'Y'
+#define GBPCMD_REQ_MACRO_LIST           'y'
+#define GBPCMD_REQ_MACRO_PLAY           'Z'
 
 #define GBPCMD_REP_ALIVE            'A'
 // Define these error numbers as prefix characters so we can have single
@@ -49,10 +103,79 @@ General header for gamebot-serial.
 #define GBPCMD_REP_7                '7'
 #define GBPCMD_REP_8                '8'
 #define GBPCMD_REP_9                '9'
+#define GBPCMD_REP_BUSY             GBPCMD_REP_3 // not now, ask again
 
 #define GBPCMD_REQ_QUERY_STATE_REPLY_SIZE           (14)
 // Flags for the first status byte of the GBPCMD_REQ_QUERY_STATE reply.
 #define GB_FLAGS_CONFIGURED                         (0x01)
+#define GB_FLAGS_USB_FRAMES                         (0x02) // frames are the tick
+#define GB_FLAGS_SMALL                              (0x04) // no channels, streaming, motion, turbo or macros
+
+#define GBPCMD_REQ_SERIAL_ERRORS_REPLY_SIZE         (5)
+
+#define GBPCMD_REQ_CAPACITY_REPLY_SIZE              (5)
+
+#define GBPCMD_REQ_TIME_REPLY_SIZE                  (11)
+
+#define GBPCMD_REQ_REPORT_STATS_REPLY_SIZE          (15)
+
+#define GBPCMD_REQ_STREAM_SIZE                      (9)
+#define GBPCMD_REQ_STREAM_REPLY_SIZE                (4)
+#define GBPCMD_REQ_STREAM_STATS_REPLY_SIZE          (16)
+
+#define GBPCMD_REQ_STREAM_TIMED_SIZE                (10)
+#define GBPCMD_REQ_STREAM_TIMED_REPLY_SIZE          (3)
+#define GBPCMD_REQ_JITTER_STATS_REPLY_SIZE          (18)
+
+#define GBPCMD_REQ_MACRO_LIST_REPLY_SIZE            (4+4*8) // 4 plus 4 per slot
+
+#define GBPCMD_REQ_QUEUE_FREE_REPLY_SIZE            (7) // 3 plus one per channel
+
+// Bytes per element of GBPCMD_REQ_CHANNEL.
+#define GB_CHANNEL_ELEMENT_SIZE                     (6)
+
+// Bytes per element of GBPCMD_REQ_BATCH.
+#define GB_BATCH_ELEMENT_SIZE                       (9)
+
+// Bytes per element of GBPCMD_REQ_AT, a start tick then a batch element.
+#define GB_AT_ELEMENT_SIZE                          (4+GB_BATCH_ELEMENT_SIZE)
+
+// Bytes GBPCMD_REQ_SET_CREDITS adds to the end of every v2 reply.
+#define GB_CREDITS_SIZE                             (2)
+
+// Checksum modes for GBPCMD_REQ_SET_CHECKSUM.
+#define GB_CHECKSUM_LEGACY                          (0) // lower 8 bits of crc32
+#define GB_CHECKSUM_CRC                             (1) // crc-8 v1, crc-16 v2
+
+// Tick sources for GBPCMD_REQ_SET_TICK.
+#define GB_TICK_TIMER                               (0) // Timer1 CTC, each msec
+#define GB_TICK_USB_FRAMES                          (1) // USB start of frame
+
+// Report modes for GBPCMD_REQ_SET_REPORT_MODE.
+#define GB_REPORT_ECHO                              (0) // each change ECHO_TIMES times
+#define GB_REPORT_EVERY_POLL                        (1) // the current report every poll
+
+// Stream modes for GBPCMD_REQ_STREAM_MODE.
+#define GB_STREAM_OFF                               (0) // the command queue
+#define GB_STREAM_LATEST                            (1) // the newest state
+#define GB_STREAM_JITTER                            (2) // timed frames, played out
+
+// Motion types for GBPCMD_REQ_MOTION.
+#define GB_MOTION_NONE                              (0) // stop
+#define GB_MOTION_RAMP                              (1) // straight, one speed
+#define GB_MOTION_EASE                              (2) // straight, easing in and out
+#define GB_MOTION_ARC                               (3) // round the center
+
+// Most elements in one GBPCMD_REQ_MACRO_WRITE.
+#define GB_MACRO_WRITE_MAX_ELEMENTS                 (8)
+// Flags for GBPCMD_REQ_MACRO_WRITE.
+#define GB_MACRO_START                              (0x01) // erase the slot first
+// Slot for GBPCMD_REQ_MACRO_PLAY that stops the playing macro.
+#define GB_MACRO_STOP                               (0xff)
+
+// Duration units for GBPCMD_REQ_SET_UNITS.
+#define GB_UNITS_MSEC                               (0)
+#define GB_UNITS_100USEC                            (1)
 
 #endif /* _GAMEBOTSERIAL_H */
 
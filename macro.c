@@ -0,0 +1,216 @@
+/*
+Copyright 2021 by angry-kitten
+Macros in EEPROM for gamebot-serial.
+*/
+
+#include <LUFA/Drivers/USB/USB.h>
+#include <LUFA/Platform/Platform.h>
+
+#include "gamebotserial.h"
+#include "macro.h"
+
+#if GB_HAVE_MACRO
+
+uint16_t macro_address=0; // the next EEPROM byte to play
+bool macro_playing=false;
+uint16_t macro_left=0; // elements left to play
+
+// The write Macro_Task is working through.
+bool macro_writing=false;
+uint8_t macro_write_slot=0;
+bool macro_write_erase=false; // zero the header before the elements
+uint16_t macro_write_address=0; // where the packed elements go
+uint8_t macro_write_data[MACRO_WRITE_SIZE]; // the packed elements
+uint8_t macro_write_length=0; // bytes in macro_write_data
+uint16_t macro_write_count=0; // elements in the macro once written
+uint16_t macro_write_total=0; // bytes in the macro once written
+uint8_t macro_write_step=0; // the next byte Macro_Task writes
+
+// EEPROM addresses are kept as numbers and only made pointers for the
+// eeprom functions.
+#define EEPROM_POINTER(a)       ((uint8_t *)(uintptr_t)(a))
+
+uint16_t MacroSlotAddress(uint8_t slot)
+{
+    return ((uint16_t)slot)*MACRO_SLOT_SIZE;
+}
+
+uint16_t MacroReadWord(uint16_t a)
+{
+    return (((uint16_t)eeprom_read_byte(EEPROM_POINTER(a)))<<8)|eeprom_read_byte(EEPROM_POINTER(a+1));
+}
+
+// True if the macro in slot was packed the way this firmware packs.
+bool MacroCurrent(uint8_t slot)
+{
+    return CMDQUEUE_PACK_VERSION == eeprom_read_byte(EEPROM_POINTER(MacroSlotAddress(slot)));
+}
+
+// Elements in the macro in slot, 0 if it's empty.
+uint16_t MacroCount(uint8_t slot)
+{
+    if( ! MacroCurrent(slot) )
+    {
+        return 0;
+    }
+    uint16_t count=MacroReadWord(MacroSlotAddress(slot)+1);
+    if( 0xffff == count )
+    {
+        return 0;
+    }
+    return count;
+}
+
+// Bytes the macro in slot takes, 0 if it's empty.
+uint16_t MacroLength(uint8_t slot)
+{
+    if( ! MacroCurrent(slot) )
+    {
+        return 0;
+    }
+    uint16_t length=MacroReadWord(MacroSlotAddress(slot)+3);
+    if( length > MACRO_DATA_SIZE )
+    {
+        return 0;
+    }
+    return length;
+}
+
+uint8_t MacroGet(void)
+{
+    uint8_t b=eeprom_read_byte(EEPROM_POINTER(macro_address));
+    macro_address++;
+    return b;
+}
+
+// Start a write to the end of the macro in slot, or to an empty slot if
+// start. The caller has checked that the elements fit.
+void MacroWriteBegin(uint8_t slot, bool start)
+{
+    if( macro_playing )
+    {
+        // Reading the EEPROM waits while a byte is being written.
+        MacroStop();
+    }
+
+    macro_write_slot=slot;
+    macro_write_erase=start;
+    macro_write_count=start?0:MacroCount(slot);
+    macro_write_total=start?0:MacroLength(slot);
+    macro_write_address=MacroSlotAddress(slot)+MACRO_HEADER_SIZE+macro_write_total;
+    macro_write_length=0;
+}
+
+void MacroStage(uint8_t b)
+{
+    macro_write_data[macro_write_length]=b;
+    macro_write_length++;
+}
+
+// Pack a copy of the element at pe into the write. At most
+// GB_MACRO_WRITE_MAX_ELEMENTS go in one write.
+void MacroWriteAdd(cmdqueue_element_t *pe)
+{
+    CMDQueuePack(pe,MacroStage);
+    macro_write_count++;
+    macro_write_total+=CMDQueueElementSize(pe);
+}
+
+// Hand the write to Macro_Task.
+void MacroWriteEnd(void)
+{
+    macro_write_step=0;
+    macro_writing=true;
+}
+
+// Write the next byte of the write once the EEPROM is ready for it. The
+// steps are the zeroed header if erasing, the packed elements, then the
+// new count and length and last the version.
+void Macro_Task(void)
+{
+    if( ! macro_writing || ! eeprom_is_ready() )
+    {
+        return;
+    }
+
+    uint16_t header=MacroSlotAddress(macro_write_slot);
+    uint8_t step=macro_write_step;
+    if( macro_write_erase )
+    {
+        if( step < MACRO_HEADER_SIZE )
+        {
+            eeprom_update_byte(EEPROM_POINTER(header+step),0);
+            macro_write_step++;
+            return;
+        }
+        step-=MACRO_HEADER_SIZE;
+    }
+    if( step < macro_write_length )
+    {
+        eeprom_update_byte(EEPROM_POINTER(macro_write_address+step),macro_write_data[step]);
+        macro_write_step++;
+        return;
+    }
+    step-=macro_write_length;
+    if( step < MACRO_HEADER_SIZE-1 )
+    {
+        // MSB-first count then length, after the version byte.
+        uint16_t w=(step < 2)?macro_write_count:macro_write_total;
+        uint8_t b=(step & 1)?(0xff&w):(0xff&(w>>8));
+        eeprom_update_byte(EEPROM_POINTER(header+1+step),b);
+        macro_write_step++;
+        return;
+    }
+    if( step < MACRO_HEADER_SIZE )
+    {
+        eeprom_update_byte(EEPROM_POINTER(header),CMDQUEUE_PACK_VERSION);
+        macro_write_step++;
+        return;
+    }
+
+    // The last byte has finished.
+    macro_writing=false;
+}
+
+// Start playing the macro in slot, after the current element. Returns
+// false if it's empty.
+bool MacroPlay(uint8_t slot)
+{
+    uint16_t count=MacroCount(slot);
+    if( 0 == count || 0 == MacroLength(slot) )
+    {
+        return false;
+    }
+
+    macro_address=MacroSlotAddress(slot)+MACRO_HEADER_SIZE;
+    macro_left=count;
+    macro_playing=true;
+
+    return true;
+}
+
+void MacroStop(void)
+{
+    macro_playing=false;
+}
+
+// Unpack the next element of the playing macro into pe. Returns false
+// if no macro is playing.
+bool MacroPop(cmdqueue_element_t *pe)
+{
+    if( ! macro_playing )
+    {
+        return false;
+    }
+
+    CMDQueueUnpack(pe,MacroGet);
+    macro_left--;
+    if( 0 == macro_left )
+    {
+        macro_playing=false;
+    }
+
+    return true;
+}
+
+#endif /* GB_HAVE_MACRO */
@@ -0,0 +1,55 @@
+/*
+Copyright 2021 by angry-kitten
+Macros in EEPROM for gamebot-serial.
+*/
+
+#ifndef _MACRO_H
+#define _MACRO_H
+
+#include "Joystick.h"
+#include "cmdqueue.h"
+
+// The EEPROM is split into MACRO_SLOTS slots. Each holds a macro of
+// queue elements, packed the same way as in the command queue, after a
+// header of the CMDQUEUE_PACK_VERSION it was packed with then its
+// element count and byte length, both MSB-first. A slot with another
+// version is empty, so firmware that packs differently doesn't play it.
+// Erased EEPROM reads as 0xff, an empty slot. A macro plays straight
+// from the EEPROM into the scheduler, ahead of the command queue.
+#define MACRO_SLOTS             (8)
+#define MACRO_EEPROM_SIZE       (E2END+1)
+#define MACRO_SLOT_SIZE         (MACRO_EEPROM_SIZE/MACRO_SLOTS)
+#define MACRO_HEADER_SIZE       (5)
+#if 0 == CMDQUEUE_PACK_VERSION || 0xff <= CMDQUEUE_PACK_VERSION
+#error CMDQUEUE_PACK_VERSION must not look like a zeroed or erased slot
+#endif
+#define MACRO_DATA_SIZE         (MACRO_SLOT_SIZE-MACRO_HEADER_SIZE)
+#if MACRO_DATA_SIZE < CMDQUEUE_ELEMENT_MAX_SIZE
+#error The EEPROM is too small for MACRO_SLOTS slots
+#endif
+
+// A write packs its elements into RAM and Macro_Task writes them to the
+// EEPROM a byte at a time as it is ready, about 3.4 msec a byte, so the
+// main loop never waits on it. The header goes last, its version byte
+// after the rest, so the slot only takes the new elements once they are
+// all there, and a slot being started over is erased first. The macro
+// requests are answered GBPCMD_REP_BUSY until the write is done.
+#define MACRO_WRITE_SIZE        (GB_MACRO_WRITE_MAX_ELEMENTS*CMDQUEUE_ELEMENT_MAX_SIZE)
+#if MACRO_WRITE_SIZE+2*MACRO_HEADER_SIZE > 255
+#error MACRO_WRITE_SIZE is too big for the write steps
+#endif
+
+extern bool macro_writing;
+
+// macro.c
+uint16_t MacroCount(uint8_t slot);
+uint16_t MacroLength(uint8_t slot);
+void MacroWriteBegin(uint8_t slot, bool start);
+void MacroWriteAdd(cmdqueue_element_t *pe);
+void MacroWriteEnd(void);
+void Macro_Task(void);
+bool MacroPlay(uint8_t slot);
+void MacroStop(void);
+bool MacroPop(cmdqueue_element_t *pe);
+
+#endif /* _MACRO_H */
@@ -0,0 +1,196 @@
+/*
+Copyright 2021 by angry-kitten
+On device stick motion for gamebot-serial.
+*/
+
+#include <avr/pgmspace.h>
+
+#include <LUFA/Drivers/USB/USB.h>
+#include <LUFA/Platform/Platform.h>
+
+#include "gamebotserial.h"
+#include "motion.h"
+#include "timebase.h"
+
+#if GB_HAVE_MOTION
+
+// A quarter wave of sine, sin(i*pi/128)*65535 for i from 0 to 64.
+const uint16_t sine_table[65] PROGMEM = {
+    0x0000, 0x0648, 0x0c90, 0x12d5, 0x1918, 0x1f56, 0x2590, 0x2bc4,
+    0x31f1, 0x3817, 0x3e34, 0x4447, 0x4a50, 0x504d, 0x563e, 0x5c22,
+    0x61f7, 0x67bd, 0x6d74, 0x7319, 0x78ad, 0x7e2e, 0x839c, 0x88f5,
+    0x8e39, 0x9368, 0x987f, 0x9d7f, 0xa267, 0xa736, 0xabeb, 0xb085,
+    0xb504, 0xb968, 0xbdae, 0xc1d8, 0xc5e3, 0xc9d0, 0xcd9e, 0xd14c,
+    0xd4da, 0xd847, 0xdb93, 0xdebd, 0xe1c5, 0xe4a9, 0xe76b, 0xea09,
+    0xec82, 0xeed8, 0xf108, 0xf313, 0xf4f9, 0xf6b9, 0xf853, 0xf9c7,
+    0xfb14, 0xfc3a, 0xfd3a, 0xfe12, 0xfec3, 0xff4d, 0xffb0, 0xffeb,
+    0xffff
+};
+
+// Convert degrees per second to 16.16 turns per msec,
+// 2^32/360000 is 11930.4647.
+#define STEP_PER_DEGREE_INT     (11930)
+#define STEP_PER_DEGREE_FRAC    (4647) // in 1/10000
+
+motion_t motions[MOTION_COUNT];
+
+// Sine of angle, in 1/65536 of a turn, times 65535. The quarter wave is
+// mirrored for the rest of the turn and interpolated between entries.
+int32_t MotionSin(uint16_t angle)
+{
+    uint16_t a=angle&0x3fff;
+    if( angle & 0x4000 )
+    {
+        // The second and fourth quarters run backwards.
+        a=0x4000-a;
+    }
+    uint8_t i=a>>8;
+    uint8_t frac=0xff&a;
+    uint32_t v=pgm_read_word(&(sine_table[i]));
+    if( frac )
+    {
+        uint16_t next=pgm_read_word(&(sine_table[i+1]));
+        v+=((next-v)*frac+128)>>8;
+    }
+    if( angle & 0x8000 )
+    {
+        return -(int32_t)v;
+    }
+    return v;
+}
+
+int32_t MotionCos(uint16_t angle)
+{
+    return MotionSin(angle+0x4000);
+}
+
+void MotionReset(void)
+{
+    uint8_t m;
+    for(m=0;m<MOTION_COUNT;m++)
+    {
+        MotionStop(m);
+    }
+}
+
+void MotionStop(uint8_t m)
+{
+    motions[m].type=GB_MOTION_NONE;
+}
+
+// Move from x0,y0 to x1,y1 over duration_msec, in a straight line at
+// one speed for GB_MOTION_RAMP, or easing in and out for
+// GB_MOTION_EASE.
+void MotionRamp(uint8_t m, uint8_t type, uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1, uint16_t duration_msec)
+{
+    motion_t *pm=&(motions[m]);
+
+    pm->start_tick=TickNow();
+    pm->last_tick=pm->start_tick-1;
+    pm->duration_msec=duration_msec;
+    pm->x0=x0;
+    pm->y0=y0;
+    pm->x1=x1;
+    pm->y1=y1;
+    pm->x=x0;
+    pm->y=y0;
+    pm->type=type;
+}
+
+// Go round from heading at radius, degrees_per_second clockwise or
+// negative for anticlockwise, for duration_msec or until stopped if 0.
+void MotionArc(uint8_t m, uint16_t heading, uint8_t radius, int16_t degrees_per_second, uint16_t duration_msec)
+{
+    motion_t *pm=&(motions[m]);
+
+    pm->start_tick=TickNow();
+    pm->last_tick=pm->start_tick;
+    pm->duration_msec=duration_msec;
+    pm->radius=radius;
+    pm->phase=((uint32_t)heading)<<16;
+    pm->step=(int32_t)degrees_per_second*STEP_PER_DEGREE_INT
+        +((int32_t)degrees_per_second*STEP_PER_DEGREE_FRAC)/10000;
+    pm->type=GB_MOTION_ARC;
+    pm->x=STICK_CENTER+((MotionSin(heading)*radius+32768)>>16);
+    pm->y=STICK_CENTER-((MotionCos(heading)*radius+32768)>>16);
+}
+
+// One of x0 to x1 at p, in 1/65536 of the way.
+uint8_t MotionBetween(uint8_t x0, uint8_t x1, uint32_t p)
+{
+    int32_t d=(int32_t)x1-(int32_t)x0;
+    return x0+((d*(int32_t)p+32768)>>16);
+}
+
+void MotionAdvance(motion_t *pm, uint32_t now)
+{
+    uint32_t elapsed=now-pm->start_tick;
+    if( 0 != pm->duration_msec && elapsed > pm->duration_msec )
+    {
+        // The end was shown for a tick, give the stick back.
+        pm->type=GB_MOTION_NONE;
+        return;
+    }
+
+    if( GB_MOTION_ARC == pm->type )
+    {
+        // Step the angle for each msec since the last time.
+        uint32_t t=pm->last_tick;
+        while( t != now )
+        {
+            pm->phase+=pm->step;
+            t++;
+        }
+        uint16_t angle=pm->phase>>16;
+        pm->x=STICK_CENTER+((MotionSin(angle)*pm->radius+32768)>>16);
+        pm->y=STICK_CENTER-((MotionCos(angle)*pm->radius+32768)>>16);
+    }
+    else
+    {
+        uint32_t p=65536;
+        if( elapsed < pm->duration_msec )
+        {
+            p=(elapsed<<16)/pm->duration_msec;
+            if( GB_MOTION_EASE == pm->type )
+            {
+                // Half a cosine wave, slow at each end.
+                p=(65536-MotionCos(p>>1))>>1;
+            }
+        }
+        pm->x=MotionBetween(pm->x0,pm->x1,p);
+        pm->y=MotionBetween(pm->y0,pm->y1,p);
+    }
+    pm->last_tick=now;
+}
+
+// Work out each running motion once a tick.
+void Motion_Task(void)
+{
+    uint32_t now=TickNow();
+
+    uint8_t m;
+    for(m=0;m<MOTION_COUNT;m++)
+    {
+        motion_t *pm=&(motions[m]);
+        if( GB_MOTION_NONE != pm->type && now != pm->last_tick )
+        {
+            MotionAdvance(pm,now);
+        }
+    }
+}
+
+void MotionMerge(USB_JoystickReport_Input_t *pr)
+{
+    if( GB_MOTION_NONE != motions[MOTION_LEFT].type )
+    {
+        pr->LX=motions[MOTION_LEFT].x;
+        pr->LY=motions[MOTION_LEFT].y;
+    }
+    if( GB_MOTION_NONE != motions[MOTION_RIGHT].type )
+    {
+        pr->RX=motions[MOTION_RIGHT].x;
+        pr->RY=motions[MOTION_RIGHT].y;
+    }
+}
+
+#endif /* GB_HAVE_MOTION */
@@ -0,0 +1,49 @@
+/*
+Copyright 2021 by angry-kitten
+On device stick motion for gamebot-serial.
+*/
+
+#ifndef _MOTION_H
+#define _MOTION_H
+
+#include "Joystick.h"
+
+// Each stick can run one motion, worked out every msec tick on the
+// device so a sweep or a circle takes one request instead of one per
+// step. While a motion runs it replaces that stick in the report, over
+// the command queue and the channels. A new motion replaces the old.
+#define MOTION_LEFT             (0)
+#define MOTION_RIGHT            (1)
+#define MOTION_COUNT            (2)
+
+// Angles are in 1/65536 of a turn, 0 is up and they go clockwise like
+// the headings in packetserial.py.
+typedef struct motion_t {
+    uint8_t type; // GB_MOTION_NONE when stopped
+    uint32_t start_tick; // interrupt_count when it started
+    uint32_t last_tick; // when it was last worked out
+    uint16_t duration_msec; // 0 for an arc that runs until stopped
+    uint8_t x0; // ramps run from x0,y0 to x1,y1
+    uint8_t y0;
+    uint8_t x1;
+    uint8_t y1;
+    uint8_t radius; // arcs are this far from center
+    uint32_t phase; // the arc's angle, 16.16
+    int32_t step; // added to phase each msec
+    uint8_t x; // the stick now
+    uint8_t y;
+} motion_t;
+
+extern motion_t motions[MOTION_COUNT];
+
+// motion.c
+int32_t MotionSin(uint16_t angle);
+int32_t MotionCos(uint16_t angle);
+void MotionReset(void);
+void MotionStop(uint8_t m);
+void MotionRamp(uint8_t m, uint8_t type, uint8_t x0, uint8_t y0, uint8_t x1, uint8_t y1, uint16_t duration_msec);
+void MotionArc(uint8_t m, uint16_t heading, uint8_t radius, int16_t degrees_per_second, uint16_t duration_msec);
+void Motion_Task(void);
+void MotionMerge(USB_JoystickReport_Input_t *pr);
+
+#endif /* _MOTION_H */
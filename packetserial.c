@@ -3,6 +3,9 @@ Copyright 2021 by angry-kitten
 Serial packet support written for gamebot-serial.
 */
 
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
 #include <LUFA/Drivers/USB/USB.h>
 #include <LUFA/Drivers/Peripheral/Serial.h>
 #include <LUFA/Platform/Platform.h>
@@ -10,9 +13,30 @@ Serial packet support written for gamebot-serial.
 #include "gamebotserial.h"
 #include "packetserial.h"
 #include "crc.h"
-
-serial_ring_t sri={0,0,0,{0}};
-serial_ring_t sro={0,0,0,{0}};
+#include "crctable.h"
+#include "cmdqueue.h"
+#include "Joystick.h"
+#include "timebase.h"
+
+serial_ring_t sri={0,0,{0}};
+serial_ring_t sro={0,0,{0}};
+
+volatile uint16_t serial_rx_overrun_count=0;
+volatile uint16_t serial_rx_drop_count=0;
+uint32_t serial_rx_end_tick=0; // interrupt_count at the end of the packet being run
+uint32_t serial_rx_end_usec=0; // TimerMicros() at the end of the packet being run
+
+// The interrupt adds stamps at serial_stamp_head and the parser takes
+// them from serial_stamp_tail. Both count up and wrap.
+serial_stamp_t serial_stamps[SERIAL_STAMP_COUNT];
+volatile uint8_t serial_stamp_head=0;
+volatile uint8_t serial_stamp_tail=0;
+
+uint32_t serial_baud=SERIAL_DEFAULT_BAUD; // current rate
+uint32_t serial_baud_pending=0; // rate to switch to once sro drains
+uint32_t serial_baud_previous=0; // rate to go back to if the probe fails
+uint32_t serial_baud_probe_start=0; // interrupt_count when the rate changed
+bool serial_baud_probing=false;
 
 /*
 Packet format
@@ -29,39 +53,97 @@ byte -1 = packet end, SP_END
 #define SP_MAX_SIZE         (19)
 #define SP_LEN_INVERT       (0xf0)
 
-uint8_t packet_length=0;
-uint8_t packet[SP_MAX_SIZE];
-uint8_t reply_packet_length=0;
-uint8_t reply_packet[SP_MAX_SIZE];
+/*
+Protocol v2 packet format
+byte 0 == delimiter, SP2_DELIMITER
+byte n == COBS encoded data followed by the checksum
+byte -1 = delimiter, SP2_DELIMITER
+
+COBS (Consistent Overhead Byte Stuffing) removes every zero byte from
+the data so a zero can only be a delimiter. A v2 packet is selected by
+its leading delimiter and resync is a scan for the next delimiter.
+
+The data is one or more requests, each prefixed by its length. Each
+request gets its own v2 reply packet holding just the reply data.
+*/
+#define SP2_DELIMITER       (0x00)
+#define SP2_MAX_CODE        (0xff) // a run of 254 bytes with no zero after
+
+// Packet parser states. Each received byte is looked at once.
+#define SP_STATE_IDLE       (0) // looking for SP_START or SP2_DELIMITER
+#define SP_STATE_LENGTH     (1) // v1 length byte
+#define SP_STATE_DATA       (2) // v1 data
+#define SP_STATE_CHECKSUM   (3) // v1 checksum
+#define SP_STATE_END        (4) // v1 SP_END
+#define SP_STATE_V2         (5) // v2 COBS bytes up to the delimiter
+
+uint8_t sp_state=SP_STATE_IDLE;
+uint8_t packet_length=0; // data bytes collected so far
+uint8_t packet_data_length=0; // v1 data bytes expected
+uint8_t packet_checksum=0; // v1 checksum byte as received
+uint32_t packet_crc=0; // running checksum of the collected data
+uint8_t packet[SP2_MAX_FRAME_SIZE]; // decoded data, v1 or v2
+
+// v2 COBS decoding as the bytes arrive.
+bool packet2_bad=false; // too long or bad encoding
+uint8_t cobs_code=0; // current code byte
+uint8_t cobs_left=0; // bytes left in the current code block
+bool cobs_zero_pending=false; // a zero goes in before the next block
+
+// Which framing replies are sent in, the same as the request's.
+uint8_t reply_protocol=SP_PROTOCOL_V1;
+
+// A reply is sent as header, data, trailer and checksum. The header
+// holds the sequence prefix when the request had one. The trailer holds
+// the credits when they are turned on.
+uint8_t reply_header[2];
+uint8_t reply_header_length=0;
+uint8_t *reply_data=NULL;
+uint8_t reply_data_length=0;
+uint8_t reply_trailer[GB_CREDITS_SIZE];
+uint8_t reply_trailer_length=0;
+uint8_t reply_checksum[2];
+uint8_t reply_checksum_length=0;
+// When set, ReplyPacket() also copies the reply data here.
+uint8_t *reply_capture=NULL;
+uint8_t reply_capture_size=0;
+uint8_t reply_capture_length=0;
+
+// Append free queue bytes and free serial input bytes to v2 replies.
+bool reply_credits=false;
+
+// GB_CHECKSUM_LEGACY is the lower 8 bits of a bit at a time crc32.
+// GB_CHECKSUM_CRC uses the flash lookup tables in crctable.c, crc-8 for
+// v1 packets and crc-16 for v2 packets.
+uint8_t checksum_mode=GB_CHECKSUM_LEGACY;
 
 uint8_t SerialRingUsed(serial_ring_t *rp)
 {
-    return rp->count;
+    uint8_t u=(rp->head-rp->tail)&SERIAL_RING_MASK;
+    return u;
 }
 
 uint8_t SerialRingFree(serial_ring_t *rp)
 {
-    uint8_t f=(SERIAL_RING_SIZE-1)-(rp->count);
+    uint8_t f=SERIAL_RING_MASK-SerialRingUsed(rp);
     return f;
 }
 
-void SerialRingAdd(serial_ring_t *rp, uint8_t b)
+// Called only by the producer side of the ring.
+// Returns false if the ring was full and b was thrown away.
+bool SerialRingAdd(serial_ring_t *rp, uint8_t b)
 {
-    uint8_t f=SerialRingFree(rp);
-    if( 0 == f )
-    {
-        return; // Throw b away.
-    }
-    
-    if( 1 == f )
+    uint8_t head=rp->head;
+    uint8_t next=(head+1)&SERIAL_RING_MASK;
+    if( next == rp->tail )
     {
-        // indicate buffer full and force an error
-        b='X';
+        return false; // Throw b away.
     }
 
-    rp->ring[rp->head]=b;
-    rp->head=(rp->head+1)%SERIAL_RING_SIZE;
-    rp->count++;
+    rp->ring[head]=b;
+    // Publish the byte only after it is stored.
+    rp->head=next;
+    return true;
 }
 
 void SerialRingAddString(serial_ring_t *rp, const char *s)
@@ -79,138 +161,606 @@ void SerialRingAddString(serial_ring_t *rp, const char *s)
     }
 }
 
+// Called only by the consumer side of the ring.
 uint8_t SerialRingPop(serial_ring_t *rp)
 {
-    uint8_t u=SerialRingUsed(rp);
-    if( 0 == u )
+    uint8_t tail=rp->tail;
+    if( tail == rp->head )
     {
         return 0;
     }
-    uint8_t returnme=rp->ring[rp->tail];
-    rp->tail=(rp->tail+1)%SERIAL_RING_SIZE;
-    rp->count--;
+    uint8_t returnme=rp->ring[tail];
+    // Release the slot only after it is read.
+    rp->tail=(tail+1)&SERIAL_RING_MASK;
     return returnme;
 }
 
-void SerialOutRingTask(void)
+// Called by the parser with each byte that may end a packet, before it
+// is parsed. position is its index in sri. The stamps are in the order
+// of their bytes so the byte's stamp, if it has one, is the oldest.
+void SerialStampTake(uint8_t position)
 {
-    uint8_t u=SerialRingUsed(&sro);
-    if( 0 == u )
+    uint8_t tail=serial_stamp_tail;
+    if( tail != serial_stamp_head )
+    {
+        serial_stamp_t *ps=&(serial_stamps[tail&SERIAL_STAMP_MASK]);
+        if( position == ps->position )
+        {
+            serial_rx_end_tick=ps->tick;
+            serial_rx_end_usec=ps->usec;
+            // Release the stamp only after it is read.
+            serial_stamp_tail=tail+1;
+            return;
+        }
+    }
+
+    // It wasn't stamped. Now is late but at least it is this packet's.
+    serial_rx_end_tick=TickNow();
+    serial_rx_end_usec=TimerMicros();
+}
+
+// Start receiving into sri from the USART receive complete interrupt.
+// Call after Serial_Init().
+void SerialInterruptInit(void)
+{
+    UCSR1B |= (1 << RXCIE1);
+}
+
+// Check that the clock can make baud closely enough. Normal speed is
+// preferred since it samples each bit more times. Double speed is used
+// when it gets closer to the requested rate.
+bool SerialBaudCheck(uint32_t baud, bool *pdouble_speed)
+{
+    if( baud < SERIAL_MIN_BAUD || baud > SERIAL_MAX_BAUD )
+    {
+        return false;
+    }
+
+    uint8_t speed;
+    for(speed=0;speed<2;speed++)
+    {
+        uint32_t div=(speed?8:16);
+        uint32_t ubrr=((F_CPU/div)+(baud/2))/baud;
+        if( ubrr < 1 || ubrr > 4096 )
+        {
+            continue;
+        }
+        uint32_t actual=F_CPU/(div*ubrr);
+        uint32_t diff=(actual>baud)?(actual-baud):(baud-actual);
+        if( diff*1000 <= baud*SERIAL_BAUD_TOLERANCE )
+        {
+            *pdouble_speed=(speed?true:false);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void SerialSetBaud(uint32_t baud)
+{
+    bool double_speed=false;
+    if( ! SerialBaudCheck(baud,&double_speed) )
+    {
+        return;
+    }
+
+    // Serial_Init() rewrites UCSR1B so the interrupts need to be
+    // turned back on.
+    Serial_Init(baud,double_speed);
+    SerialInterruptInit();
+    serial_baud=baud;
+}
+
+// Switch to baud after everything in sro has been sent. The new rate is
+// kept only if a valid packet arrives within SERIAL_BAUD_PROBE_MSEC.
+bool SerialRequestBaud(uint32_t baud)
+{
+    bool double_speed=false;
+    if( ! SerialBaudCheck(baud,&double_speed) )
+    {
+        return false;
+    }
+
+    serial_baud_pending=baud;
+    return true;
+}
+
+// A valid packet arrived so the current rate works.
+void SerialBaudConfirm(void)
+{
+    serial_baud_probing=false;
+}
+
+void SerialBaudTask(void)
+{
+    uint32_t ic=TickNow();
+
+    if( serial_baud_pending )
+    {
+        // Wait for the reply at the old rate to finish.
+        if( SerialRingUsed(&sro) > 0 )
+        {
+            return;
+        }
+        if( ! (UCSR1A & (1 << UDRE1)) || ! Serial_IsSendComplete() )
+        {
+            return;
+        }
+
+        serial_baud_previous=serial_baud;
+        SerialSetBaud(serial_baud_pending);
+        serial_baud_pending=0;
+        serial_baud_probe_start=ic;
+        serial_baud_probing=true;
+        return;
+    }
+
+    if( serial_baud_probing )
     {
+        if( (ic-serial_baud_probe_start) >= SERIAL_BAUD_PROBE_MSEC )
+        {
+            // Nothing valid arrived at the new rate. Go back.
+            serial_baud_probing=false;
+            SerialSetBaud(serial_baud_previous);
+        }
+    }
+}
+
+ISR (USART1_RX_vect) // USART receive complete interrupt
+{
+    // The status must be read before the data register.
+    uint8_t status=UCSR1A;
+    uint8_t b=UDR1;
+
+    if( status & (1 << DOR1) )
+    {
+        // At least one byte was lost before this one.
+        serial_rx_overrun_count++;
+    }
+
+    uint8_t position=sri.head;
+    if( ! SerialRingAdd(&sri,b) )
+    {
+        serial_rx_drop_count++;
         return;
     }
 
-    if( ! Serial_IsSendReady() )
+    if( SP2_DELIMITER == b || SP_END == b )
+    {
+        // This may end a packet. Stamp it here rather than when the
+        // main loop gets to it so GBPCMD_REQ_TIME isn't thrown off by
+        // the loop.
+        uint8_t head=serial_stamp_head;
+        if( (uint8_t)(head-serial_stamp_tail) < SERIAL_STAMP_COUNT )
+        {
+            serial_stamp_t *ps=&(serial_stamps[head&SERIAL_STAMP_MASK]);
+            ps->position=position;
+            ps->tick=interrupt_count;
+            ps->usec=TimerMicros();
+            // Publish the stamp only after it is stored.
+            serial_stamp_head=head+1;
+        }
+    }
+}
+
+ISR (USART1_UDRE_vect) // USART data register empty interrupt
+{
+    if( SerialRingUsed(&sro) == 0 )
     {
+        // Nothing left to send. Stop until more is added.
+        UCSR1B &= ~(1 << UDRIE1);
         return;
     }
 
-    uint8_t b=SerialRingPop(&sro);
+    // Clear the transmit complete flag so it only shows once the last
+    // byte has been shifted out.
+    UCSR1A |= (1 << TXC1);
+    UDR1=SerialRingPop(&sro);
+}
 
-    Serial_SendByte(b);
+// Start the transmit interrupt if there is anything in sro. The
+// interrupt sends the whole ring back-to-back and then turns itself off.
+void SerialOutRingTask(void)
+{
+    uint8_t u=SerialRingUsed(&sro);
+    if( 0 == u )
+    {
+        return;
+    }
+
+    // If the interrupt turns itself off between the read and the write
+    // of UCSR1B this just turns it back on, and it will fire once more
+    // and find the ring empty.
+    UCSR1B |= (1 << UDRIE1);
 }
 
-uint8_t SerialRingPeek(serial_ring_t *rp, uint8_t offset)
+// Add b to sro, waiting for room. Replies are sent from the main loop
+// with interrupts on, so the transmit interrupt drains sro at line rate
+// and a reply longer than the ring just waits for the bytes ahead of it.
+void SerialOutRingPut(uint8_t b)
 {
-    uint8_t u=SerialRingUsed(&sri);
-    if( offset >= u )
+    while( ! SerialRingAdd(&sro,b) )
     {
-        // can't peek past the end of data
-        return 0;
+        SerialOutRingTask();
     }
+}
 
-    uint8_t index=(rp->tail+offset)%SERIAL_RING_SIZE;
-    uint8_t returnme=rp->ring[index];
-    return returnme;
+// Number of checksum bytes for the framing.
+uint8_t ChecksumSize(uint8_t protocol)
+{
+    if( GB_CHECKSUM_CRC == checksum_mode && SP_PROTOCOL_V2 == protocol )
+    {
+        return 2;
+    }
+    return 1;
 }
 
-void SerialPacketTask(void)
+uint32_t ChecksumStart(uint8_t protocol)
 {
-    while(true)
+    if( GB_CHECKSUM_CRC == checksum_mode )
     {
-        // See how much is in the input ring.
-        uint8_t u=SerialRingUsed(&sri);
-        if( u < SP_MIN_SIZE )
+        if( SP_PROTOCOL_V2 == protocol )
         {
-            // Not enough data for a packet.
-            return;
+            return CRC16_INITIAL_VALUE;
         }
+        return CRC8_INITIAL_VALUE;
+    }
+    return INITIAL_VALUE;
+}
 
-        // Look at the first byte without removing it from the ring.
-        uint8_t fb=SerialRingPeek(&sri,0);
-        if( SP_START != fb )
+uint32_t ChecksumUpdate(uint8_t protocol, uint32_t c, uint8_t b)
+{
+    if( GB_CHECKSUM_CRC == checksum_mode )
+    {
+        if( SP_PROTOCOL_V2 == protocol )
         {
-            // Throw the start byte away.
-            (void)SerialRingPop(&sri);
-            continue;
+            return CRC16Update((uint16_t)c,b);
         }
+        return CRC8Update((uint8_t)c,b);
+    }
+    return F_CRC_ActualizaByte(c,b);
+}
 
-        // Look at the encoded length.
-        uint8_t lengths=SerialRingPeek(&sri,1);
-        lengths^=SP_LEN_INVERT;
-        uint8_t l1=lengths&0x0f;
-        uint8_t l2=(lengths&0xf0)>>4;
+uint16_t ChecksumFinish(uint8_t protocol, uint32_t c)
+{
+    if( GB_CHECKSUM_CRC == checksum_mode )
+    {
+        return (uint16_t)c;
+    }
+    return F_CRC_Finaliza(c)&0xff;
+}
 
-        if( l1 != l2 )
+// Add a decoded byte to packet and to the running checksum. v2 checksum
+// bytes are decoded along with the data, so for v2 the checksum lags
+// behind by their size and ends up covering just the data.
+void SerialPacketAppend(uint8_t b)
+{
+    if( packet_length >= sizeof(packet) )
+    {
+        packet2_bad=true;
+        return;
+    }
+
+    if( SP_STATE_V2 == sp_state )
+    {
+        uint8_t lag=ChecksumSize(SP_PROTOCOL_V2);
+        if( packet_length >= lag )
         {
-            // Throw the start byte away.
-            (void)SerialRingPop(&sri);
-            break; // continue;
+            packet_crc=ChecksumUpdate(SP_PROTOCOL_V2,packet_crc,packet[packet_length-lag]);
         }
+    }
+    else
+    {
+        packet_crc=ChecksumUpdate(SP_PROTOCOL_V1,packet_crc,b);
+    }
+    packet[packet_length]=b;
+    packet_length++;
+}
 
-        // start, lengths, data, checksum, end
-        uint8_t computed_length=1+1+l1+1+1;
+// Throw away anything collected and look for the next packet.
+void SerialPacketReset(void)
+{
+    sp_state=SP_STATE_IDLE;
+    packet_length=0;
+}
 
-        if( u < computed_length )
+// Start over at b. b may be the start of the next packet.
+void SerialPacketRestart(uint8_t b)
+{
+    SerialPacketReset();
+
+    if( SP_START == b )
+    {
+        sp_state=SP_STATE_LENGTH;
+        packet_crc=ChecksumStart(SP_PROTOCOL_V1);
+    }
+    else if( SP2_DELIMITER == b )
+    {
+        sp_state=SP_STATE_V2;
+        packet_crc=ChecksumStart(SP_PROTOCOL_V2);
+        packet2_bad=false;
+        cobs_code=0;
+        cobs_left=0;
+        cobs_zero_pending=false;
+    }
+}
+
+// Run one received byte through the packet parser.
+void SerialPacketByte(uint8_t b)
+{
+    switch(sp_state)
+    {
+        default:
+        case SP_STATE_IDLE:
+            SerialPacketRestart(b);
+            break;
+
+        case SP_STATE_LENGTH:
         {
-            // Not enough data has arrived yet.
+            uint8_t lengths=b^SP_LEN_INVERT;
+            uint8_t l1=lengths&0x0f;
+            uint8_t l2=(lengths&0xf0)>>4;
+            if( l1 != l2 )
+            {
+                SerialPacketRestart(b);
+                break;
+            }
+            packet_data_length=l1;
+            sp_state=(l1>0)?SP_STATE_DATA:SP_STATE_CHECKSUM;
             break;
         }
 
-        // Verify the end byte;
-        uint8_t e=SerialRingPeek(&sri,computed_length-1);
-        if( SP_END != e )
+        case SP_STATE_DATA:
+            SerialPacketAppend(b);
+            if( packet_length >= packet_data_length )
+            {
+                sp_state=SP_STATE_CHECKSUM;
+            }
+            break;
+
+        case SP_STATE_CHECKSUM:
+            packet_checksum=b;
+            sp_state=SP_STATE_END;
+            break;
+
+        case SP_STATE_END:
+            if( SP_END != b )
+            {
+                SerialPacketRestart(b);
+                break;
+            }
+            ProcessPacket();
+            SerialPacketReset();
+            break;
+
+        case SP_STATE_V2:
+            if( SP2_DELIMITER == b )
+            {
+                if( packet_length > 0 || cobs_left > 0 )
+                {
+                    // A partial code block means the packet is cut short.
+                    if( cobs_left > 0 )
+                    {
+                        packet2_bad=true;
+                    }
+                    ProcessPacket2();
+                }
+                // Every v2 packet has its own leading delimiter. Not
+                // treating this one as a start keeps a stray zero from
+                // holding the parser in v2 mode.
+                SerialPacketReset();
+                break;
+            }
+
+            if( 0 == cobs_left )
+            {
+                // This is a code byte.
+                if( cobs_zero_pending )
+                {
+                    SerialPacketAppend(0);
+                }
+                cobs_code=b;
+                cobs_left=b-1;
+            }
+            else
+            {
+                SerialPacketAppend(b);
+                cobs_left--;
+            }
+            cobs_zero_pending=(0 == cobs_left && cobs_code < SP2_MAX_CODE);
+            break;
+    }
+}
+
+void SerialPacketTask(void)
+{
+    while( SerialRingUsed(&sri) > 0 )
+    {
+        uint8_t position=sri.tail;
+        uint8_t b=SerialRingPop(&sri);
+        if( SP2_DELIMITER == b || SP_END == b )
         {
-            // Throw the start byte away.
-            (void)SerialRingPop(&sri);
-            break; // continue;
+            SerialStampTake(position);
         }
+        SerialPacketByte(b);
+    }
+}
+
+// Send the reply in v1 framing. n is the length of the header, data
+// and checksum.
+void SendReplyPacket(uint8_t n)
+{
+    uint8_t dlen=n-reply_checksum_length;
+    uint8_t l=dlen|(dlen<<4);
+    l^=SP_LEN_INVERT;
 
+    SerialOutRingPut(SP_START);
+    SerialOutRingPut(l);
+    uint8_t i;
+    for(i=0;i<n;i++)
+    {
+        SerialOutRingPut(ReplyPacketByte(i));
+    }
+    SerialOutRingPut(SP_END);
+}
+
+// Send the reply in v2 framing. n is the length of the header, data
+// and checksum.
+void SendReplyPacket2(uint8_t n)
+{
+    SerialOutRingPut(SP2_DELIMITER);
+
+    // COBS encode the bytes as they are added.
+    uint8_t i=0;
+    while(true)
+    {
+        // Find the run of non-zero bytes.
+        uint8_t run=0;
+        while( (i+run) < n && run < (SP2_MAX_CODE-1) )
+        {
+            if( 0 == ReplyPacketByte(i+run) )
+            {
+                break;
+            }
+            run++;
+        }
 
-        // It looks like a packet.
-        packet_length=computed_length;
-        uint8_t i;
-        for(i=0;i<computed_length;i++)
+        SerialOutRingPut(run+1);
+        uint8_t k;
+        for(k=0;k<run;k++)
         {
-            packet[i]=SerialRingPop(&sri);
+            SerialOutRingPut(ReplyPacketByte(i+k));
         }
+        i+=run;
 
-        ProcessPacket();
+        if( i >= n )
+        {
+            break;
+        }
+        if( run < (SP2_MAX_CODE-1) )
+        {
+            // Skip the zero the code byte stands for.
+            i++;
+        }
+    }
+
+    SerialOutRingPut(SP2_DELIMITER);
+}
+
+// Return byte i of the reply being sent, header then data then trailer
+// then checksum.
+uint8_t ReplyPacketByte(uint8_t i)
+{
+    if( i < reply_header_length )
+    {
+        return reply_header[i];
     }
+    i-=reply_header_length;
+    if( i < reply_data_length )
+    {
+        return reply_data[i];
+    }
+    i-=reply_data_length;
+    if( i < reply_trailer_length )
+    {
+        return reply_trailer[i];
+    }
+    i-=reply_trailer_length;
+    return reply_checksum[i];
+}
+
+// Prefix replies with the sequence number of the request they answer.
+void ReplySequenceBegin(uint8_t seq)
+{
+    reply_header[0]=GBPCMD_REQ_SEQUENCE;
+    reply_header[1]=seq;
+    reply_header_length=2;
 }
 
+void ReplySequenceEnd(void)
+{
+    reply_header_length=0;
+}
+
+// Keep a copy of the next reply's data, up to size bytes.
+void ReplyCaptureBegin(uint8_t *d, uint8_t size)
+{
+    reply_capture=d;
+    reply_capture_size=size;
+    reply_capture_length=0;
+}
+
+// Return the length of the captured reply, 0 if there was none or it
+// didn't fit.
+uint8_t ReplyCaptureEnd(void)
+{
+    reply_capture=NULL;
+    return reply_capture_length;
+}
+
+// Send a reply in the same framing as the request.
 void ReplyPacket(uint8_t *d, uint8_t dlen)
 {
-    if( dlen > SP_MAX_DATA_SIZE )
+    uint8_t protocol=reply_protocol;
+    uint8_t max=(SP_PROTOCOL_V2 == protocol)?SP2_MAX_DATA_SIZE:SP_MAX_DATA_SIZE;
+    reply_trailer_length=0;
+    if( reply_credits && SP_PROTOCOL_V2 == protocol )
+    {
+        // Queue credits are free queue bytes, at most 255.
+        // 0              1
+        // Queue credits, Serial input credits
+        reply_trailer[0]=CMDQueueFree();
+        reply_trailer[1]=SerialRingFree(&sri);
+        reply_trailer_length=GB_CREDITS_SIZE;
+    }
+
+    uint16_t body_length=reply_header_length+dlen+reply_trailer_length;
+    if( dlen > max || body_length > max )
     {
         return;
     }
 
-    uint8_t l=dlen|(dlen<<4);
-    l^=SP_LEN_INVERT;
+    reply_data=d;
+    reply_data_length=dlen;
 
-    SerialRingAdd(&sro,SP_START);
-    SerialRingAdd(&sro,l);
-    int i=0;
-    for(i=0;i<dlen;i++)
+    if( reply_capture && dlen <= reply_capture_size )
     {
-        SerialRingAdd(&sro,d[i]);
+        memcpy(reply_capture,d,dlen);
+        reply_capture_length=dlen;
     }
 
-    uint8_t crc32ish=LowerEightCRC32(d,dlen);
-    SerialRingAdd(&sro,crc32ish);
+    uint32_t c=ChecksumStart(protocol);
+    uint8_t i;
+    for(i=0;i<body_length;i++)
+    {
+        c=ChecksumUpdate(protocol,c,ReplyPacketByte(i));
+    }
+    uint16_t cs=ChecksumFinish(protocol,c);
+
+    // The checksum goes after the data, MSB-first.
+    reply_checksum_length=ChecksumSize(protocol);
+    if( 2 == reply_checksum_length )
+    {
+        reply_checksum[0]=0xff&(cs>>8);
+        reply_checksum[1]=0xff&cs;
+    }
+    else
+    {
+        reply_checksum[0]=0xff&cs;
+    }
 
-    SerialRingAdd(&sro,SP_END);
+    if( SP_PROTOCOL_V2 == protocol )
+    {
+        SendReplyPacket2(body_length+reply_checksum_length);
+    }
+    else
+    {
+        SendReplyPacket(body_length+reply_checksum_length);
+    }
+
+    // Start sending right away instead of waiting for the main loop.
+    SerialOutRingTask();
 }
 
 // Return the lower 8 bits of a crc32.
@@ -220,40 +770,75 @@ uint8_t LowerEightCRC32(uint8_t *data, uint8_t data_len)
     return (crc1&0xff);
 }
 
+// Called once the v1 end byte arrives. packet holds just the data.
 void ProcessPacket(void)
 {
-    uint8_t pl=packet_length;
-    packet_length=0;
+    reply_protocol=SP_PROTOCOL_V1;
 
-    if( pl < 4 )
+    uint8_t crc8ish=ChecksumFinish(SP_PROTOCOL_V1,packet_crc);
+    if( packet_checksum != crc8ish )
     {
         ReplyError();
         return;
     }
 
-    if( SP_START != packet[0] )
+    SerialBaudConfirm();
+    ProcessRequest(packet,packet_length);
+}
+
+// Called at the closing v2 delimiter. packet holds the decoded data
+// followed by the checksum.
+void ProcessPacket2(void)
+{
+    reply_protocol=SP_PROTOCOL_V2;
+
+    // At least one length prefix, one request byte and the checksum.
+    uint8_t cslen=ChecksumSize(SP_PROTOCOL_V2);
+    if( packet2_bad || packet_length < (2+cslen) )
     {
         ReplyError();
         return;
     }
 
-    if( SP_END != packet[pl-1] )
+    uint8_t data_len=packet_length-cslen;
+    uint16_t packet_c=packet[data_len];
+    if( 2 == cslen )
+    {
+        packet_c=(packet_c<<8)|packet[data_len+1];
+    }
+    uint16_t c=ChecksumFinish(SP_PROTOCOL_V2,packet_crc);
+
+    if( packet_c != c )
     {
         ReplyError();
         return;
     }
 
-    uint8_t *data=&(packet[2]);
-    uint8_t data_len=pl-4;
-
-    uint8_t packet_crc32ish=packet[pl-2];
-    uint8_t crc32ish=LowerEightCRC32(data,data_len);
+    SerialBaudConfirm();
 
-    if( packet_crc32ish != crc32ish )
+    // Check every length prefix before running any request, so a frame
+    // that gets an error reply had no side effects and is safe to send
+    // again.
+    uint8_t i=0;
+    while( i < data_len )
     {
-        ReplyError();
-        return;
+        uint8_t rl=packet[i];
+        i++;
+        if( 0 == rl || rl > (data_len-i) )
+        {
+            ReplyError();
+            return;
+        }
+        i+=rl;
     }
 
-    ProcessRequest(data,data_len);
+    // Walk the length prefixed requests.
+    i=0;
+    while( i < data_len )
+    {
+        uint8_t rl=packet[i];
+        i++;
+        ProcessRequest(&(packet[i]),rl);
+        i+=rl;
+    }
 }
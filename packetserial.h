@@ -6,28 +6,128 @@ Serial packet support written for gamebot-serial.
 #ifndef _PACKETSERIAL_H
 #define _PACKETSERIAL_H
 
+// The rings are single-producer/single-consumer. The producer only
+// writes head and the consumer only writes tail so one side can be an
+// interrupt handler without locking. The size must be a power of two.
+#if RAM_SIZE >= 2560
+#define SERIAL_RING_SIZE    (64)
+#else
 #define SERIAL_RING_SIZE    (32)
+#endif
+#define SERIAL_RING_MASK    (SERIAL_RING_SIZE-1)
+#if (SERIAL_RING_SIZE & SERIAL_RING_MASK) || (SERIAL_RING_SIZE > 256)
+#error SERIAL_RING_SIZE must be a power of two no larger than 256
+#endif
 typedef struct serial_ring_t {
-    uint8_t head; // incremented as bytes added
-    uint8_t tail; // incremented as bytes removed
-    uint8_t count; // number of bytes of data present
-    uint8_t ring[SERIAL_RING_SIZE];
+    volatile uint8_t head; // incremented as bytes added
+    volatile uint8_t tail; // incremented as bytes removed
+    volatile uint8_t ring[SERIAL_RING_SIZE];
 } serial_ring_t;
 
 extern serial_ring_t sri;
 extern serial_ring_t sro;
 
+#define SP_PROTOCOL_V1      (1)
+#define SP_PROTOCOL_V2      (2)
+
+extern uint8_t checksum_mode;
+extern bool reply_credits;
+
+// Largest protocol v2 data, not counting the checksum. It has to hold
+// the longest reply with its sequence prefix and credits.
+#if RAM_SIZE >= 2560
+#define SP2_MAX_DATA_SIZE   (250)
+#else
+#define SP2_MAX_DATA_SIZE   (40)
+#endif
+#if SP2_MAX_DATA_SIZE < (2+GBPCMD_REQ_MACRO_LIST_REPLY_SIZE+GB_CREDITS_SIZE)
+#error SP2_MAX_DATA_SIZE is too small for the longest reply
+#endif
+// data, checksum, COBS code bytes
+#define SP2_MAX_FRAME_SIZE  (SP2_MAX_DATA_SIZE+2+2)
+
+#define SERIAL_DEFAULT_BAUD     (9600)
+#define SERIAL_MIN_BAUD         (9600)
+#define SERIAL_MAX_BAUD         (1000000)
+#define SERIAL_BAUD_TOLERANCE   (25) // parts per thousand
+#define SERIAL_BAUD_PROBE_MSEC  (1000)
+
+extern uint32_t serial_baud;
+
+// Receive error counters, maintained by the receive interrupt.
+extern volatile uint16_t serial_rx_overrun_count; // lost in the USART
+extern volatile uint16_t serial_rx_drop_count; // lost because sri was full
+extern uint32_t serial_rx_end_tick; // when the packet being run ended
+extern uint32_t serial_rx_end_usec; // and in usec
+
+// The receive interrupt stamps each byte that may end a packet with the
+// time and its place in sri. The parser takes the stamp of the byte that
+// does end one, so a later packet's bytes can't move it. A byte is left
+// unstamped if the stamps are full.
+#if RAM_SIZE >= 2560
+#define SERIAL_STAMP_COUNT  (8)
+#else
+#define SERIAL_STAMP_COUNT  (2)
+#endif
+#define SERIAL_STAMP_MASK   (SERIAL_STAMP_COUNT-1)
+#if (SERIAL_STAMP_COUNT & SERIAL_STAMP_MASK)
+#error SERIAL_STAMP_COUNT must be a power of two
+#endif
+typedef struct serial_stamp_t {
+    uint8_t position; // index in sri of the byte
+    uint32_t tick; // interrupt_count when it arrived
+    uint32_t usec; // TimerMicros() when it arrived
+} serial_stamp_t;
+
+// GBPCMD_REQ_ONCE remembers the ids of the last few requests and their
+// replies so a retransmitted request is answered without running it
+// again. Replies that don't fit aren't kept, those requests run again.
+#if RAM_SIZE >= 2560
+#define RECENT_REQUEST_COUNT    (8)
+#else
+#define RECENT_REQUEST_COUNT    (2)
+#endif
+#define RECENT_REPLY_SIZE       (4)
+typedef struct recent_request_t {
+    uint16_t id;
+    uint8_t reply_length; // 0 if unused or the reply didn't fit
+    uint8_t reply[RECENT_REPLY_SIZE];
+} recent_request_t;
+
 // packetserial.c
 uint8_t SerialRingUsed(serial_ring_t *rp);
 uint8_t SerialRingFree(serial_ring_t *rp);
-void SerialRingAdd(serial_ring_t *rp, uint8_t b);
+bool SerialRingAdd(serial_ring_t *rp, uint8_t b);
 void SerialRingAddString(serial_ring_t *rp, const char *s);
 uint8_t SerialRingPop(serial_ring_t *rp);
+void SerialStampTake(uint8_t position);
+void SerialInterruptInit(void);
+bool SerialBaudCheck(uint32_t baud, bool *pdouble_speed);
+void SerialSetBaud(uint32_t baud);
+bool SerialRequestBaud(uint32_t baud);
+void SerialBaudConfirm(void);
+void SerialBaudTask(void);
 void SerialOutRingTask(void);
-uint8_t SerialRingPeek(serial_ring_t *rp, uint8_t offset);
+void SerialOutRingPut(uint8_t b);
+uint8_t ChecksumSize(uint8_t protocol);
+uint32_t ChecksumStart(uint8_t protocol);
+uint32_t ChecksumUpdate(uint8_t protocol, uint32_t c, uint8_t b);
+uint16_t ChecksumFinish(uint8_t protocol, uint32_t c);
+void SerialPacketAppend(uint8_t b);
+void SerialPacketReset(void);
+void SerialPacketRestart(uint8_t b);
+void SerialPacketByte(uint8_t b);
 void SerialPacketTask(void);
 void ProcessPacket(void);
+void ProcessPacket2(void);
 uint8_t LowerEightCRC32(uint8_t *data, uint8_t data_len);
+void SendReplyPacket(uint8_t n);
+void SendReplyPacket2(uint8_t n);
+uint8_t ReplyPacketByte(uint8_t i);
+void ReplySequenceBegin(uint8_t seq);
+void ReplySequenceEnd(void);
+void ReplyCaptureBegin(uint8_t *d, uint8_t size);
+uint8_t ReplyCaptureEnd(void);
 void ReplyPacket(uint8_t *d, uint8_t dlen);
 
 // request.c
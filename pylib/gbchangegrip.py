@@ -21,39 +21,28 @@ def main(args):
 
     ps.OpenAndClear()
 
+    # The device times the wait after each press, the host only sends
+    # as many elements as the queue has room for.
+    wait_msec=1000
+    elements=[]
+
     # L and R may need to be pressed 3+ times
-    ps.press_L_and_R()
-    time.sleep(1) # second
-    ps.press_L_and_R()
-    time.sleep(1) # second
-    ps.press_L_and_R()
-    time.sleep(1) # second
-    ps.press_L_and_R()
-    time.sleep(1) # second
-    ps.press_L_and_R()
-    time.sleep(1) # second
-
-    ps.press_A()
-    time.sleep(1) # second
-    ps.press_B()
-    time.sleep(1) # second
-
-    ps.press_hat_LEFT()
-    time.sleep(1) # second
-    ps.press_hat_LEFT()
-    time.sleep(1) # second
-    ps.press_hat_LEFT()
-    time.sleep(1) # second
-    ps.press_hat_LEFT()
-    time.sleep(1) # second
-
-    ps.press_hat_TOP()
-    time.sleep(1) # second
-
-    ps.press_A()
+    for i in range(5):
+        elements+=ps.press_elements(ps.SWITCH_L|ps.SWITCH_R,wait_msec=wait_msec)
+
+    elements+=ps.press_elements(ps.SWITCH_A,wait_msec=wait_msec)
+    elements+=ps.press_elements(ps.SWITCH_B,wait_msec=wait_msec)
+
+    for i in range(4):
+        elements+=ps.press_elements(hat=ps.HAT_LEFT,wait_msec=wait_msec)
+
+    elements+=ps.press_elements(hat=ps.HAT_TOP,wait_msec=wait_msec)
+
+    elements+=ps.press_elements(ps.SWITCH_A)
+
+    ps.send_batch(elements)
 
     ps.Close()
 
 if __name__ == "__main__":
     main(sys.argv)
-
@@ -20,25 +20,23 @@ def main(args):
     ps=packetserial.PacketSerial()
     ps.OpenAndClear()
 
-    ps.press_HOME()
-    time.sleep(1) # second
+    # The device times the wait after each press, the host only sends
+    # as many elements as the queue has room for.
+    wait_msec=1000
+    elements=[]
 
-    ps.press_hat_BOTTOM()
-    time.sleep(1) # second
+    elements+=ps.press_elements(ps.SWITCH_HOME,wait_msec=wait_msec)
 
-    ps.press_hat_RIGHT()
-    time.sleep(1) # second
-    ps.press_hat_RIGHT()
-    time.sleep(1) # second
-    ps.press_hat_RIGHT()
-    time.sleep(1) # second
-    ps.press_hat_RIGHT()
-    time.sleep(1) # second
+    elements+=ps.press_elements(hat=ps.HAT_BOTTOM,wait_msec=wait_msec)
 
-    ps.press_A()
-    time.sleep(1) # second
+    for i in range(4):
+        elements+=ps.press_elements(hat=ps.HAT_RIGHT,wait_msec=wait_msec)
 
-    ps.press_A()
+    elements+=ps.press_elements(ps.SWITCH_A,wait_msec=wait_msec)
+
+    elements+=ps.press_elements(ps.SWITCH_A)
+
+    ps.send_batch(elements)
 
     ps.Close()
 
@@ -30,6 +30,10 @@ def query_state(ps):
         print("configured")
     else:
         print("not configured")
+    if flags & ps.GB_FLAGS_USB_FRAMES:
+        print("timed by usb frames")
+    else:
+        print("timed by timer")
     print(f"head={head}")
     print(f"tail={tail}")
     print(f"count={count}")
@@ -40,7 +44,8 @@ def query_state(ps):
     ic1=ic
     cem1=cem
 
-    time.sleep(test_time_sec)
+    # Sample the clock over the test time instead of just sleeping.
+    ps.SyncClock(samples=20,interval_seconds=test_time_sec/20)
 
     (flags,head,tail,count,ic,cem,echo_count)=ps.request_query_state()
     print(f"flags={flags}")
@@ -60,6 +65,29 @@ def query_state(ps):
 
     print("interrupt rate",calculate_rate(ic1,ic2,test_time_sec),"per second")
     print("command elapsed rate",calculate_rate(cem1,cem2,test_time_sec),"per second")
+    print("synced rate",ps.clock_rate,"per second")
+    print(f"clock drift={ps.ClockDriftPPM():.1f} ppm")
+    best=min(d for (h,t,d) in ps.clock_samples)
+    print(f"best round trip={best*1000:.3f} msec")
+    if ps.device_drift_ppm is not None:
+        print(f"device timer drift against usb frames={ps.device_drift_ppm} ppm")
+
+    (overrun,dropped)=ps.request_serial_errors()
+    print(f"serial overrun={overrun}")
+    print(f"serial dropped={dropped}")
+
+    stats=ps.request_report_stats()
+    if stats is not None:
+        print(f"reports={stats['reports']} delivered={stats['delivered']}")
+        print(f"current report sent {stats['current_count']} times, the one before {stats['previous_count']}")
+        print(f"first delivery last={stats['last_first_usec']} max={stats['max_first_usec']} mean={stats['mean_first_usec']} usec")
+
+    c=ps.request_capacity()
+    if c is not None:
+        (queue,ring,max_data)=c
+        print(f"queue bytes={queue}")
+        print(f"serial input ring={ring}")
+        print(f"max v2 data={max_data}")
 
 
 def open_and_test():
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+#
+# Copyright 2021 by angry-kitten
+# Serial packet support written for gamebot-serial.
+# Cross check the firmware checksums against this library.
+#
+
+import sys
+import os
+import time
+import random
+
+import packetserial
+
+# Each request is a test request padded with random bytes. The device
+# ignores the padding, so it only answers alive if its checksum of the
+# whole request matches ours, and we only accept the reply if our
+# checksum of it matches the device's.
+
+def check_values(ps):
+    # The standard check values for "123456789".
+    good=True
+    if 0xf4 != ps.CRC8(b'123456789'):
+        print("crc-8 check value bad")
+        good=False
+    if 0x29b1 != ps.CRC16(b'123456789'):
+        print("crc-16 check value bad")
+        good=False
+    return good
+
+def random_request(max_padding):
+    req=bytearray(packetserial.PacketSerial.GBPCMD_REQ_TEST)
+    n=random.randint(0,max_padding)
+    for i in range(n):
+        req.append(random.randint(0,255))
+    return req
+
+def cross_check(ps,protocol,max_padding,count):
+    ps.protocol=protocol
+    failures=0
+    for i in range(count):
+        req=random_request(max_padding)
+        rep=ps.RequestNoRetry(req)
+        if ps.GBPCMD_REP_ALIVE != rep:
+            print(f"mismatch req=[{req.hex()}]")
+            failures+=1
+    print(f"protocol {protocol} checksum mode {ps.checksum_mode}: {count-failures}/{count} good")
+    return failures
+
+def open_and_test():
+    count=200
+
+    ps=packetserial.PacketSerial()
+    if not check_values(ps):
+        return
+
+    ps.OpenAndClear(negotiate=False)
+    ps.NegotiateBaud()
+
+    # Size the v2 requests to the device, leaving room for the length
+    # prefix and the test byte. Devices that can't say have at least the
+    # data of a board with little RAM.
+    c=ps.request_capacity()
+    max_data=ps.SP2_MAX_DATA_SIZE_SMALL if c is None else c[2]
+
+    failures=0
+    for mode in [ps.GB_CHECKSUM_LEGACY,ps.GB_CHECKSUM_CRC]:
+        ps.protocol=1
+        if not ps.SetChecksum(mode):
+            print(f"set checksum mode {mode} failed")
+            failures+=1
+            continue
+        failures+=cross_check(ps,1,ps.SP_MAX_DATA_SIZE-1,count)
+        failures+=cross_check(ps,2,max_data-2,count)
+
+    ps.protocol=1
+    if failures > 0:
+        print(f"{failures} failures")
+    else:
+        print("all good")
+
+    ps.Close()
+
+def main(args):
+    print("gamebot test crc")
+    open_and_test()
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -16,16 +16,12 @@ def open_and_test():
     ps.OpenAndClear()
 
     ps.move_left_joy_up(1000)
-    time.sleep(1)
 
     ps.move_left_joy_left(1000)
-    time.sleep(1)
 
     ps.move_left_joy_down(1000)
-    time.sleep(1)
 
     ps.move_left_joy_right(1000)
-    time.sleep(1)
 
     ps.Close()
 
@@ -8,10 +8,26 @@ import sys
 import os
 import time
 import math
+import random
 import serial
 import zlib
 import serial.tools.list_ports
 
+def make_crc_table(width,polynomial):
+    """Build a 256 entry lookup table for a non-reflected crc."""
+    table=[]
+    topbit=1<<(width-1)
+    mask=(1<<width)-1
+    for i in range(256):
+        c=i<<(width-8)
+        for bit in range(8):
+            if c & topbit:
+                c=((c<<1)^polynomial)&mask
+            else:
+                c=(c<<1)&mask
+        table.append(c)
+    return table
+
 class PacketSerial:
 
     if "posix" == os.name:
@@ -36,6 +52,13 @@ class PacketSerial:
 
     default_baud=9600
 
+    # Rates OpenAndClear() tries to switch to, fastest first. The device
+    # rejects any rate its clock can't make accurately.
+    negotiate_bauds=[1000000,500000,250000,115200]
+    # The device goes back to the old rate if nothing valid arrives at the
+    # new rate within 1 second. Wait a little longer than that.
+    baud_probe_seconds=1.5
+
     SWITCH_Y=0x0001
     SWITCH_B=0x0002
     SWITCH_A=0x0004
@@ -86,6 +109,32 @@ class PacketSerial:
     GBPCMD_REQ_CLEAR_STATE=b'C'
     GBPCMD_REQ_PAUSE_MSEC=b'P'
     GBPCMD_REQ_REPORT_PENDING=b'p'
+    GBPCMD_REQ_SERIAL_ERRORS=b'e'
+    GBPCMD_REQ_SET_BAUD=b'N'
+    GBPCMD_REQ_SET_CHECKSUM=b'K'
+    GBPCMD_REQ_SEQUENCE=b'#' # wraps another request
+    GBPCMD_REQ_ONCE=b'!' # wraps a request with an id
+    GBPCMD_REQ_BATCH=b'X'
+    GBPCMD_REQ_SET_CREDITS=b'F'
+    GBPCMD_REQ_CAPACITY=b'c'
+    GBPCMD_REQ_QUEUE_FREE=b'f'
+    GBPCMD_REQ_CHANNEL=b'V'
+    GBPCMD_REQ_AT=b'A'
+    GBPCMD_REQ_TIME=b't'
+    GBPCMD_REQ_SET_TICK=b'u'
+    GBPCMD_REQ_SET_UNITS=b'm'
+    GBPCMD_REQ_SET_REPORT_MODE=b'i'
+    GBPCMD_REQ_REPORT_STATS=b'I'
+    GBPCMD_REQ_STREAM_MODE=b'W'
+    GBPCMD_REQ_STREAM=b'w'
+    GBPCMD_REQ_STREAM_STATS=b'j'
+    GBPCMD_REQ_STREAM_TIMED=b'J'
+    GBPCMD_REQ_JITTER_STATS=b'k'
+    GBPCMD_REQ_MOTION=b'G'
+    GBPCMD_REQ_TURBO=b'z'
+    GBPCMD_REQ_MACRO_WRITE=b'Y'
+    GBPCMD_REQ_MACRO_LIST=b'y'
+    GBPCMD_REQ_MACRO_PLAY=b'Z'
 
     GBPCMD_REP_ALIVE=b'A'
     # Define these error numbers as prefix characters so we can have single
@@ -100,34 +149,208 @@ class PacketSerial:
     GBPCMD_REP_7=b'7'
     GBPCMD_REP_8=b'8'
     GBPCMD_REP_9=b'9'
+    GBPCMD_REP_BUSY=GBPCMD_REP_3 # not now, ask again
 
     GBPCMD_REQ_QUERY_STATE_REPLY_SIZE=14
     GB_FLAGS_CONFIGURED=0x01
+    GB_FLAGS_USB_FRAMES=0x02 # frames are the tick
+    GB_FLAGS_SMALL=0x04 # no channels, streaming, motion, turbo or macros
+
+    # Tick sources for GBPCMD_REQ_SET_TICK.
+    GB_TICK_TIMER=0 # Timer1 CTC, each msec
+    GB_TICK_USB_FRAMES=1 # USB start of frame, one per host poll
+
+    # Report modes for GBPCMD_REQ_SET_REPORT_MODE.
+    GB_REPORT_ECHO=0 # each change a few times, then nothing
+    GB_REPORT_EVERY_POLL=1 # the current report on every poll
+    GBPCMD_REQ_REPORT_STATS_REPLY_SIZE=15
+    GBPCMD_REQ_STREAM_REPLY_SIZE=4
+    GBPCMD_REQ_STREAM_STATS_REPLY_SIZE=16
+    GBPCMD_REQ_STREAM_TIMED_REPLY_SIZE=3
+    GBPCMD_REQ_JITTER_STATS_REPLY_SIZE=18
+
+    # Flags for GBPCMD_REQ_MACRO_WRITE and the stop slot for
+    # GBPCMD_REQ_MACRO_PLAY.
+    GB_MACRO_START=0x01 # erase the slot first
+    GB_MACRO_STOP=0xff
+    GB_MACRO_WRITE_MAX_ELEMENTS=8
+    # A macro write is answered before the device has written it to the
+    # EEPROM, about 3.4 msec a byte. Until then the macro requests are
+    # answered GBPCMD_REP_BUSY and are sent again this often, for up to
+    # macro_busy_seconds.
+    macro_busy_poll_seconds=0.02
+    macro_busy_seconds=2.0
+
+    # Sticks and motion types for GBPCMD_REQ_MOTION.
+    MOTION_LEFT=0
+    MOTION_RIGHT=1
+    GB_MOTION_NONE=0 # stop
+    GB_MOTION_RAMP=1 # straight, one speed
+    GB_MOTION_EASE=2 # straight, easing in and out
+    GB_MOTION_ARC=3 # round the center
+
+    # Stream modes for GBPCMD_REQ_STREAM_MODE.
+    GB_STREAM_OFF=0 # the command queue
+    GB_STREAM_LATEST=1 # the newest state from stream()
+    GB_STREAM_JITTER=2 # timed frames from stream_timed(), played out
+
+    # Duration units for GBPCMD_REQ_SET_UNITS.
+    GB_UNITS_MSEC=0
+    GB_UNITS_100USEC=1
+    duration_units=GB_UNITS_MSEC
+
+    GBPCMD_REQ_SERIAL_ERRORS_REPLY_SIZE=5
+
+    GBPCMD_REQ_CAPACITY_REPLY_SIZE=5
+
+    GBPCMD_REQ_QUEUE_FREE_REPLY_SIZE=7
+
+    # Channels for GBPCMD_REQ_CHANNEL. Each has its own timeline that runs
+    # alongside the queue, and while one of its elements is held it
+    # replaces that part of the report.
+    CHANNEL_BUTTONS=0
+    CHANNEL_HAT=1
+    CHANNEL_LEFT=2 # LX in the high byte, LY in the low
+    CHANNEL_RIGHT=3 # RX in the high byte, RY in the low
+    CHANNEL_COUNT=4
+    GB_CHANNEL_ELEMENT_SIZE=6
+    channel_credits=[None]*CHANNEL_COUNT # unknown
+
+    GBPCMD_REQ_TIME_REPLY_SIZE=11
+    DRIFT_UNKNOWN=-32768
+    device_drift_ppm=None # the device's timer against USB frames, unknown
+    # Clock sync. Each GBPCMD_REQ_TIME exchange gives a sample of
+    # (host seconds, device ticks, round trip delay). A line fit through
+    # the samples with the least delay maps time.monotonic() to ticks.
+    clock_samples=[]
+    clock_max_samples=32
+    clock_delay_slack_seconds=0.002 # samples this far over the best are used
+    clock_min_span_seconds=2.0 # shorter and the rate isn't trusted
+    clock_sync_seconds=1.0 # how often to take a sample when mapping
+    clock_last_tick=None # the last raw tick, to unwrap 32 bits
+    clock_wraps=0
+    clock_rate=1000.0 # device ticks per host second
+    clock_host_ref=None # host seconds where the fit is pinned
+    clock_device_ref=None # device ticks at clock_host_ref
+
+    GB_BATCH_ELEMENT_SIZE=9
+    # Elements in one GBPCMD_REQ_BATCH. A request id plus 6 elements
+    # fits the smallest v2 packet of firmware without
+    # GBPCMD_REQ_CAPACITY. NegotiateCapacity() sets it to what the device
+    # can take.
+    batch_max_elements=6
+    macro_max_elements=6
+    # A start tick and a batch element per GBPCMD_REQ_AT element.
+    GB_AT_ELEMENT_SIZE=4+GB_BATCH_ELEMENT_SIZE
+    at_max_elements=4
+    DEFAULT_PRESS_MSEC=55 # DEFAULT_BUTTON_PRESS_DURATION in the firmware
+
+    # Bytes GBPCMD_REQ_SET_CREDITS adds to the end of every v2 reply.
+    GB_CREDITS_SIZE=2
+    # Queue bytes the device can hold, None for firmware that doesn't
+    # say. The device packs each element into 1 to 10 bytes.
+    queue_capacity=None
+    # Set for boards with too little RAM for the channels, streaming,
+    # motion, turbo and macros. Those requests get an error reply.
+    small_board=False
+    # Queue credits are one byte.
+    QUEUE_CREDITS_MAX=255
+    # Longest release gap the device keeps in the element it releases.
+    RELEASE_MAX_MSEC=0x7fff
+    # With credits on, every v2 reply says how many queue bytes and
+    # serial input bytes the device has free. Without them the host asks
+    # with GBPCMD_REQ_QUEUE_FREE and counts down. Either way requests
+    # that queue elements wait until there's room for them instead of
+    # being answered with overflow.
+    use_credits=False
+    queue_credits=None # unknown
+    rx_credits=None # unknown
+    # How long to wait before asking again when the queue is full.
+    credit_poll_seconds=0.005
 
     SP_START=b'P'
     SP_END=b'E'
     SP_LEN_INVERT=0xf0
+    SP_MAX_DATA_SIZE=15
+
+    SP2_DELIMITER=b'\x00'
+    SP2_MAX_CODE=0xff
+    SP2_MAX_DATA_SIZE=250
+    SP2_MAX_DATA_SIZE_SMALL=40 # boards with little RAM
+
+    # Framing used by Request(). OpenAndClear() switches to 2 if the
+    # device supports it.
+    protocol=1
+
+    # Requests RequestWindowed() keeps in flight at once, and how long it
+    # waits for each reply before sending that request again.
+    window=4
+    window_timeout_seconds=0.25
+    window_tries=3
+    sequence=0
+
+    # How long ReplyPacket() and ReplyPacket2() wait for a reply. With
+    # request ids a retry can't run a command twice, so this can be short.
+    reply_timeout_seconds=1
+    # Wrap commands that queue input in GBPCMD_REQ_ONCE. Off until
+    # NegotiateRequestIds() finds the device knows about request ids.
+    use_request_ids=False
+    request_id=random.randint(0,0xffff)
+
+    # Checksum modes for GBPCMD_REQ_SET_CHECKSUM.
+    GB_CHECKSUM_LEGACY=0 # lower 8 bits of crc32
+    GB_CHECKSUM_CRC=1 # crc-8 for v1, crc-16 for v2
+    checksum_mode=GB_CHECKSUM_LEGACY
+
+    # These match crctable.c in the firmware.
+    crc8_table=make_crc_table(8,0x07)
+    crc16_table=make_crc_table(16,0x1021)
 
     def LowerEightCRC32(self,b):
         v = zlib.crc32(b)
         return v & 0xff
 
+    def CRC8(self,b):
+        c=0x00
+        for x in b:
+            c=self.crc8_table[c^x]
+        return c
+
+    def CRC16(self,b):
+        c=0xffff
+        for x in b:
+            c=((c<<8)&0xffff)^self.crc16_table[(c>>8)^x]
+        return c
+
+    def Checksum(self,b,protocol):
+        """Return the checksum bytes of b for the framing and the current
+        checksum mode."""
+        if self.GB_CHECKSUM_CRC == self.checksum_mode:
+            if 2 == protocol:
+                c=self.CRC16(b)
+                return bytes([(c>>8)&0xff,c&0xff])
+            return bytes([self.CRC8(b)])
+        return bytes([self.LowerEightCRC32(b)])
+
     def RequestPacket(self,s,bs):
         """Write a request packet to the serial line."""
         datalen=len(bs)
+        if datalen > self.SP_MAX_DATA_SIZE:
+            # The length nibble can't hold it.
+            raise ValueError("request of %d bytes is longer than the %d protocol v1 allows" % (datalen,self.SP_MAX_DATA_SIZE))
         ba=bytearray(bs)
         ba.insert(0,self.SP_START[0])
         l2=datalen|(datalen<<4)
         l2=l2^self.SP_LEN_INVERT
         ba.insert(1,l2)
-        ba.append(self.LowerEightCRC32(bs))
+        ba+=self.Checksum(bs,1)
         ba.append(self.SP_END[0])
         s.write(ba)
         s.write(bytes('\r\n','utf-8')) # append cr and nl to help with debugging
 
     def ReplyPacket(self,s):
         """Read a reply packet from the serial line."""
-        timeout_seconds=1 # second
+        timeout_seconds=self.reply_timeout_seconds
         start_time_seconds=time.monotonic()
         while True:
             if s.in_waiting <= 0:
@@ -160,34 +383,581 @@ class PacketSerial:
         if self.SP_END[0] != endbyte[0]:
             print("bad end byte")
             return bytes(0)
-        crc32ish=self.LowerEightCRC32(databytes)
-        if checksum[0] != crc32ish:
+        if checksum != self.Checksum(databytes,1):
+            print("bad checksum")
+            return bytes(0)
+        return databytes
+
+    def EncodeCOBS(self,b):
+        """Remove the zero bytes from b with Consistent Overhead Byte Stuffing."""
+        out=bytearray()
+        i=0
+        n=len(b)
+        while True:
+            run=0
+            while i+run < n and run < self.SP2_MAX_CODE-1 and b[i+run] != 0:
+                run+=1
+            out.append(run+1)
+            out+=b[i:i+run]
+            i+=run
+            if i >= n:
+                break
+            if run < self.SP2_MAX_CODE-1:
+                i+=1 # skip the zero the code byte stands for
+        return out
+
+    def DecodeCOBS(self,b):
+        """Undo EncodeCOBS(). Returns None if b is not valid."""
+        out=bytearray()
+        i=0
+        n=len(b)
+        while i < n:
+            code=b[i]
+            i+=1
+            if code == 0 or i+code-1 > n:
+                return None
+            out+=b[i:i+code-1]
+            i+=code-1
+            if code < self.SP2_MAX_CODE and i < n:
+                out.append(0)
+        return out
+
+    def RequestPacket2(self,s,reqs):
+        """Write a protocol v2 request packet holding one or more requests."""
+        ba=bytearray()
+        for req in reqs:
+            ba.append(len(req))
+            ba+=req
+        ba+=self.Checksum(ba,2)
+        p=bytearray(self.SP2_DELIMITER)
+        p+=self.EncodeCOBS(ba)
+        p+=self.SP2_DELIMITER
+        s.write(p)
+
+    def ReplyPacket2(self,s):
+        """Read a protocol v2 reply packet from the serial line."""
+        timeout_seconds=self.reply_timeout_seconds
+        start_time_seconds=time.monotonic()
+        started=False
+        encoded=bytearray()
+        while True:
+            if s.in_waiting <= 0:
+                time_now_seconds=time.monotonic()
+                time_delta_seconds=time_now_seconds-start_time_seconds
+                if time_delta_seconds >= timeout_seconds:
+                    print("timeout")
+                    return bytes(0)
+                time.sleep(0.01) # sleep 10 milliseconds
+                continue
+            b=s.read()
+            if self.SP2_DELIMITER == b:
+                if len(encoded) > 0:
+                    break
+                started=True
+                continue
+            if started:
+                encoded+=b
+            else:
+                print("b=",b)
+        return self.DecodeReplyPacket2(encoded)
+
+    def DecodeReplyPacket2(self,encoded):
+        """Decode and check the bytes between two v2 delimiters."""
+        data=self.DecodeCOBS(encoded)
+        checksum_size=len(self.Checksum(b'',2))
+        if data is None or len(data) < checksum_size:
+            print("bad encoding")
+            return bytes(0)
+        databytes=bytes(data[:-checksum_size])
+        if bytes(data[-checksum_size:]) != self.Checksum(databytes,2):
             print("bad checksum")
             return bytes(0)
+        if self.use_credits:
+            if len(databytes) <= self.GB_CREDITS_SIZE:
+                print("missing credits")
+                return bytes(0)
+            self.queue_credits=databytes[-2]
+            self.rx_credits=databytes[-1]
+            databytes=databytes[:-self.GB_CREDITS_SIZE]
         return databytes
 
+    def PollReplyPackets2(self,s):
+        """Read whatever has arrived and return a list of the complete
+        protocol v2 replies in it. A partial reply is kept for the next
+        call."""
+        n=s.in_waiting
+        if n > 0:
+            self.rx_buffer+=s.read(n)
+        reps=[]
+        while True:
+            i=self.rx_buffer.find(self.SP2_DELIMITER)
+            if i < 0:
+                break
+            encoded=bytes(self.rx_buffer[:i])
+            del self.rx_buffer[:i+1]
+            if len(encoded) <= 0:
+                continue
+            rep=self.DecodeReplyPacket2(encoded)
+            if len(rep) > 0:
+                reps.append(rep)
+        return reps
+
+    # reqs is a list of bytes or bytearray
+    # Send all of reqs in one protocol v2 packet and return a list of
+    # the replies in the same order.
+    def RequestMultiNoRetry(self,reqs):
+        self.RequestPacket2(self.Device,reqs)
+        reps=[]
+        for req in reqs:
+            rep=self.ReplyPacket2(self.Device)
+            reps.append(rep)
+            if len(rep) <= 0:
+                break
+        return reps
+
     # req is a bytes or bytearray
     def RequestNoRetry(self,req):
+        if 2 == self.protocol:
+            self.RequestPacket2(self.Device,[req])
+            rep=self.ReplyPacket2(self.Device)
+            return rep
         self.RequestPacket(self.Device,req)
         rep=self.ReplyPacket(self.Device)
         return rep
 
+    def NextSequence(self):
+        self.sequence=(self.sequence+1)&0xff
+        return self.sequence
+
+    def SendSequenced(self,seq,req):
+        sreq=bytearray(self.GBPCMD_REQ_SEQUENCE)
+        sreq.append(seq)
+        sreq+=req
+        self.RequestPacket2(self.Device,[sreq])
+
+    # reqs is a list of bytes or bytearray
+    # Send reqs keeping up to window of them in flight. The device echoes
+    # each sequence number so replies are matched even out of order. A
+    # request whose reply doesn't come back within window_timeout_seconds
+    # is sent again by itself. Returns the replies in the order of reqs,
+    # an empty reply for any that never came back.
+    def RequestWindowed(self,reqs):
+        if 2 != self.protocol:
+            # Sequence numbers need v2 framing to fit every reply.
+            return [self.Request(req) for req in reqs]
+        reps=[bytes(0)]*len(reqs)
+        pending={} # sequence number -> [index in reqs, time sent, tries]
+        next_index=0
+        while next_index < len(reqs) or len(pending) > 0:
+            while next_index < len(reqs) and len(pending) < self.window:
+                if not self.HaveCredits(reqs[next_index],[reqs[p[0]] for p in pending.values()]):
+                    if len(pending) <= 0:
+                        # Nothing in flight to bring back new credits.
+                        time.sleep(self.credit_poll_seconds)
+                        self.RefreshCredits()
+                    break
+                seq=self.NextSequence()
+                self.SendSequenced(seq,reqs[next_index])
+                pending[seq]=[next_index,time.monotonic(),1]
+                next_index+=1
+            for rep in self.PollReplyPackets2(self.Device):
+                if len(rep) < 2 or self.GBPCMD_REQ_SEQUENCE != rep[0:1]:
+                    print("unsequenced reply",rep)
+                    continue
+                seq=rep[1]
+                if seq not in pending:
+                    # A late reply to a request that was sent again.
+                    continue
+                reps[pending[seq][0]]=rep[2:]
+                if not self.use_credits and self.GBPCMD_REP_SUCCESS == rep[2:] and self.queue_credits is not None:
+                    self.queue_credits-=self.QueueCost(reqs[pending[seq][0]])
+                del pending[seq]
+            time_now_seconds=time.monotonic()
+            for seq,p in list(pending.items()):
+                if time_now_seconds-p[1] < self.window_timeout_seconds:
+                    continue
+                if p[2] >= self.window_tries:
+                    print("request failure")
+                    del pending[seq]
+                    continue
+                self.SendSequenced(seq,reqs[p[0]])
+                p[1]=time_now_seconds
+                p[2]+=1
+            time.sleep(0.001)
+        return reps
+
+    def NextRequestId(self):
+        self.request_id=(self.request_id+1)&0xffff
+        return self.request_id
+
+    # req is a bytes or bytearray
+    # Return req wrapped with a new request id. Sending the result more
+    # than once runs req on the device only once.
+    def WrapOnce(self,req):
+        rid=self.NextRequestId()
+        oreq=bytearray(self.GBPCMD_REQ_ONCE)
+        oreq.append((rid>>8)&0xff)
+        oreq.append(rid&0xff)
+        oreq+=req
+        return oreq
+
+    # req is a bytes or bytearray
+    # Like Request() but a retry after a lost reply gets the first reply
+    # back instead of running req again. A protocol v1 request with no
+    # room for the id is sent as it is.
+    def RequestOnce(self,req):
+        if not self.use_request_ids:
+            return self.Request(req)
+        oreq=self.WrapOnce(req)
+        if 2 != self.protocol and len(oreq) > self.SP_MAX_DATA_SIZE:
+            return self.Request(req)
+        return self.Request(oreq)
+
+    # e is a tuple from element()
+    # Return the bytes e takes packed in the device's queue, the same as
+    # CMDQueueElementSize() in the firmware. release_msec is the release
+    # gap when the element releases itself. at is true when it has a
+    # start time. Durations in 100 usec units are marked as well.
+    def ElementSize(self,e,release_msec=None,at=False):
+        (buttons,hat,LX,LY,RX,RY,duration_msec)=e
+        size=1 # field mask
+        if at or self.GB_UNITS_100USEC == self.duration_units:
+            size+=1+1 # extended marker and flags
+        if at:
+            size+=4
+        if 0 != duration_msec or e == self.element() and release_msec is None:
+            # A zero field mask is kept for extended elements, so an
+            # element that would have one stores its zero duration.
+            size+=2
+        if release_msec is not None:
+            size+=1 if release_msec < 0x80 else 2
+        if 0 != buttons:
+            size+=2
+        if self.HAT_CENTER != hat:
+            size+=1
+        for v in [LX,LY,RX,RY]:
+            if self.STICK_CENTER != v:
+                size+=1
+        return size
+
+    def PressCost(self,down,rest):
+        """The queue bytes of a press request, the down element made from
+        the request's fields and duration, then a release."""
+        msec=self.DEFAULT_PRESS_MSEC
+        if len(rest) >= 1:
+            msec=rest[0]<<8
+            if len(rest) >= 2:
+                msec|=rest[1]
+        down=down[:6]+(msec,)
+        return self.ElementSize(down,0)
+
+    def IsRelease(self,e):
+        return e[:6] == self.element()[:6] and e[6] <= self.RELEASE_MAX_MSEC
+
+    # elements is a list of tuples from element()
+    # Return the queue bytes of elements sent in one batch. The device
+    # folds a release into the element before it.
+    def BatchCost(self,elements):
+        cost=0
+        i=0
+        while i < len(elements):
+            if i+1 < len(elements) and self.IsRelease(elements[i+1]):
+                cost+=self.ElementSize(elements[i],elements[i+1][6])
+                i+=2
+            else:
+                cost+=self.ElementSize(elements[i])
+                i+=1
+        return cost
+
+    # req is a bytes or bytearray
+    # Return how many queue bytes req adds if it succeeds.
+    def QueueCost(self,req):
+        if len(req) < 1:
+            return 0
+        prefix=req[0:1]
+        if self.GBPCMD_REQ_ONCE == prefix:
+            return self.QueueCost(req[3:])
+        if self.GBPCMD_REQ_SEQUENCE == prefix:
+            return self.QueueCost(req[2:])
+        if self.GBPCMD_REQ_BATCH == prefix:
+            elements=[]
+            for i in range(2,len(req)-self.GB_BATCH_ELEMENT_SIZE+1,self.GB_BATCH_ELEMENT_SIZE):
+                b=req[i:i+self.GB_BATCH_ELEMENT_SIZE]
+                elements.append(((b[0]<<8)|b[1],b[2],b[3],b[4],b[5],b[6],(b[7]<<8)|b[8]))
+            return self.BatchCost(elements)
+        if self.GBPCMD_REQ_AT == prefix:
+            cost=0
+            for i in range(2,len(req)-self.GB_AT_ELEMENT_SIZE+1,self.GB_AT_ELEMENT_SIZE):
+                b=req[i+4:i+self.GB_AT_ELEMENT_SIZE]
+                e=((b[0]<<8)|b[1],b[2],b[3],b[4],b[5],b[6],(b[7]<<8)|b[8])
+                cost+=self.ElementSize(e,at=True)
+            return cost
+        if self.GBPCMD_REQ_PRESS_ALL == prefix and len(req) >= 8:
+            return self.PressCost(self.element((req[1]<<8)|req[2],req[3],req[4],req[5],req[6],req[7]),req[8:])
+        if self.GBPCMD_REQ_PRESS_BUTTONS == prefix and len(req) >= 3:
+            return self.PressCost(self.element((req[1]<<8)|req[2]),req[3:])
+        if self.GBPCMD_REQ_MOVE_LEFT_JOY == prefix and len(req) >= 3:
+            return self.PressCost(self.element(LX=req[1],LY=req[2]),req[3:])
+        if self.GBPCMD_REQ_MOVE_RIGHT_JOY == prefix and len(req) >= 3:
+            return self.PressCost(self.element(RX=req[1],RY=req[2]),req[3:])
+        if self.GBPCMD_REQ_PRESS_HAT == prefix and len(req) >= 2:
+            return self.PressCost(self.element(hat=req[1]),req[2:])
+        return 0
+
+    def WireSeconds(self,data):
+        """Roughly how long data takes on the wire as one packet."""
+        if 2 == self.protocol:
+            n=self.FrameSize(data)
+        else:
+            # start, lengths, checksum, end
+            n=len(data)+4
+        # start and stop bits
+        return n*10/self.Device.baudrate
+
+    def FrameSize(self,req):
+        """Roughly the serial input bytes req takes as a v2 packet."""
+        # delimiters, COBS code, record length
+        return len(req)+len(self.Checksum(b'',2))+4
+
+    def RefreshCredits(self):
+        """Ask the device how much room it has."""
+        if self.use_credits:
+            rep=self.RequestNoRetry(self.GBPCMD_REQ_TEST)
+            return self.GBPCMD_REP_ALIVE == rep
+        return self.RefreshQueueFree()
+
+    def RefreshQueueFree(self):
+        """Ask the device how much room its queue and channels have."""
+        rep=self.RequestNoRetry(self.GBPCMD_REQ_QUEUE_FREE)
+        if len(rep) != self.GBPCMD_REQ_QUEUE_FREE_REPLY_SIZE:
+            return False
+        self.queue_credits=min((rep[1]<<8)|rep[2],self.QUEUE_CREDITS_MAX)
+        self.channel_credits=list(rep[3:3+self.CHANNEL_COUNT])
+        return True
+
+    # Wait until channel has room for n more elements.
+    def WaitChannelCredits(self,channel,n):
+        if self.small_board:
+            # It has no channels, they never have room.
+            return False
+        while self.channel_credits[channel] is None or self.channel_credits[channel] < n:
+            if self.channel_credits[channel] is not None:
+                time.sleep(self.credit_poll_seconds)
+            if not self.RefreshQueueFree():
+                return False
+        return True
+
+    # req is a bytes or bytearray, in_flight a list of requests sent but
+    # not answered yet
+    # Return True if the device has room for req on top of in_flight as
+    # of the last credits it sent.
+    def HaveCredits(self,req,in_flight):
+        cost=self.QueueCost(req)
+        if cost > 0 and self.queue_capacity is not None:
+            if self.queue_credits is None:
+                return False
+            cost+=sum([self.QueueCost(r) for r in in_flight])
+            if cost > self.queue_credits:
+                return False
+        if len(in_flight) > 0 and self.use_credits and self.rx_credits is not None:
+            # The device reads a packet as it arrives, so this only
+            # limits how much can pile up behind a slow request.
+            size=self.FrameSize(req)+sum([self.FrameSize(r) for r in in_flight])
+            if size > self.rx_credits:
+                return False
+        return True
+
+    # Wait until the queue has room for cost more bytes. The queue
+    # empties on its own, so this only fails if the device stops
+    # answering or cost can never fit.
+    def WaitCredits(self,cost):
+        if cost <= 0 or self.queue_capacity is None:
+            return True
+        if cost > min(self.queue_capacity,self.QUEUE_CREDITS_MAX):
+            print("request too big for the queue")
+            return False
+        while self.queue_credits is None or self.queue_credits < cost:
+            if self.queue_credits is not None:
+                time.sleep(self.credit_poll_seconds)
+            if not self.RefreshCredits():
+                return False
+        return True
+
     # req is a bytes or bytearray
     def Request(self,req):
+        if not self.WaitCredits(self.QueueCost(req)):
+            return bytes(0)
         for retry in range(3):
             rep=self.RequestNoRetry(req)
             if len(rep) > 0:
+                if not self.use_credits and self.GBPCMD_REP_SUCCESS == rep:
+                    cost=self.QueueCost(req)
+                    if cost > 0 and self.queue_credits is not None:
+                        self.queue_credits-=cost
                 return rep
             print("request failure")
         return rep
 
-    def OpenAndClear(self):
+    def IsAliveNoRetry(self):
+        self.Device.reset_input_buffer() # clear any stale data
+        rep=self.RequestNoRetry(self.GBPCMD_REQ_TEST)
+        return self.GBPCMD_REP_ALIVE == rep
+
+    def SetBaud(self,baud):
+        """Switch the device and the host to baud. If the new rate doesn't
+        work both sides stay at the old rate and False is returned."""
+        old_baud=self.Device.baudrate
+        if baud == old_baud:
+            return True
+        if not self.request_set_baud(baud):
+            # If only the reply was lost the device may have switched.
+            time.sleep(self.baud_probe_seconds)
+            self.Device.reset_input_buffer() # clear any stale data
+            return False
+        self.Device.flush() # wait for everything to go out at the old rate
+        self.Device.baudrate=baud
+        if self.IsAliveNoRetry():
+            return True
+        # The device goes back to the old rate on its own.
+        self.Device.baudrate=old_baud
+        time.sleep(self.baud_probe_seconds)
+        self.Device.reset_input_buffer() # clear any stale data
+        return False
+
+    def FindBaud(self):
+        """Find the rate and checksum mode the device is at. A previous run
+        may have left it at a higher rate than default_baud."""
+        for baud in [self.default_baud]+self.negotiate_bauds:
+            self.Device.baudrate=baud
+            for mode in [self.GB_CHECKSUM_LEGACY,self.GB_CHECKSUM_CRC]:
+                self.checksum_mode=mode
+                if self.IsAliveNoRetry():
+                    return True
+        self.Device.baudrate=self.default_baud
+        self.checksum_mode=self.GB_CHECKSUM_LEGACY
+        return False
+
+    def NegotiateBaud(self):
+        """Switch to the fastest rate in negotiate_bauds that works."""
+        if not self.FindBaud():
+            print("device not found")
+            return False
+        for baud in self.negotiate_bauds:
+            if self.SetBaud(baud):
+                return True
+        return False
+
+    def NegotiateProtocol(self):
+        """Use protocol v2 framing if the device answers it."""
+        self.protocol=2
+        self.use_credits=False
+        self.Device.reset_input_buffer() # clear any stale data
+        # Any reply will do. Turn credits off at the same time in case a
+        # previous run left them on, the reply may still carry them.
+        rep=self.RequestNoRetry(self.credits_request(False))
+        if len(rep) > 0:
+            return True
+        self.protocol=1
+        return False
+
+    def SetChecksum(self,mode):
+        """Switch the device and the host to checksum mode."""
+        if not self.request_set_checksum(mode):
+            return False
+        self.checksum_mode=mode
+        return True
+
+    def NegotiateChecksum(self):
+        """Use the table driven crc checksums if the device has them."""
+        if self.checksum_mode == self.GB_CHECKSUM_CRC:
+            return True
+        return self.SetChecksum(self.GB_CHECKSUM_CRC)
+
+    def NegotiateCapacity(self):
+        """Size batches to the queue and packets of the device."""
+        c=self.request_capacity()
+        if c is None:
+            self.queue_capacity=None
+            self.small_board=False
+            self.batch_max_elements=6
+            self.macro_max_elements=6
+            self.at_max_elements=4
+            return False
+        (queue,ring,max_data)=c
+        self.queue_capacity=queue
+        flags=self.request_query_state()[0]
+        self.small_board=(0 != (flags & self.GB_FLAGS_SMALL))
+        # length, request id, batch prefix and count
+        n=(max_data-6)//self.GB_BATCH_ELEMENT_SIZE
+        self.batch_max_elements=max(1,n)
+        # and the macro slot and flags
+        n=(max_data-8)//self.GB_BATCH_ELEMENT_SIZE
+        self.macro_max_elements=max(1,min(n,self.GB_MACRO_WRITE_MAX_ELEMENTS))
+        n=(max_data-6)//self.GB_AT_ELEMENT_SIZE
+        self.at_max_elements=max(1,n)
+        return True
+
+    def SetCredits(self,on):
+        """Turn credits on every v2 reply on or off."""
+        if 2 != self.protocol:
+            return False
+        rep=self.RequestNoRetry(self.credits_request(on))
+        if self.GBPCMD_REP_SUCCESS != rep[0:1]:
+            return False
+        self.use_credits=on
+        self.queue_credits=None
+        self.rx_credits=None
+        return True
+
+    def NegotiateCredits(self):
+        """Use credits if the device has them."""
+        return self.SetCredits(True)
+
+    def NegotiateRequestIds(self):
+        """Use request ids if the device has them."""
+        rep=self.Request(self.WrapOnce(self.GBPCMD_REQ_TEST))
+        self.use_request_ids=(self.GBPCMD_REP_ALIVE == rep)
+        return self.use_request_ids
+
+    def OpenAndClear(self,negotiate=True):
         self.Device=serial.Serial(self.default_serial_device,self.default_baud,timeout=1)
         time.sleep(1) # delay in case the device needs time to get ready
         self.Device.reset_input_buffer() # clear any stale data
         self.Device.reset_output_buffer() # clear any stale data
+        self.protocol=1
+        self.checksum_mode=self.GB_CHECKSUM_LEGACY
+        self.use_credits=False
+        self.queue_capacity=None
+        self.queue_credits=None
+        self.rx_credits=None
+        self.channel_credits=[None]*self.CHANNEL_COUNT
+        self.duration_units=self.GB_UNITS_MSEC
+        self.device_drift_ppm=None
+        self.clock_samples=[]
+        self.clock_last_tick=None
+        self.clock_wraps=0
+        self.clock_rate=1000.0
+        self.rx_buffer=bytearray()
+        self.stream_sequence=0
+        self.use_request_ids=False
+        if negotiate:
+            self.NegotiateBaud()
+            self.NegotiateProtocol()
+            self.NegotiateChecksum()
+            self.NegotiateCredits()
+            self.NegotiateRequestIds()
+            self.NegotiateCapacity()
+            # A previous session may have left the device in other units.
+            self.request_set_units(self.GB_UNITS_MSEC)
 
     def Close(self):
+        # Leave the device the way the next run will open it.
+        if self.use_credits:
+            self.SetCredits(False)
+        if self.checksum_mode != self.GB_CHECKSUM_LEGACY:
+            self.SetChecksum(self.GB_CHECKSUM_LEGACY)
+        if self.Device.baudrate != self.default_baud:
+            self.SetBaud(self.default_baud)
         self.Device.close()
 
     # request reply functions after here
@@ -233,6 +1003,366 @@ class PacketSerial:
 
         return (flags,head,tail,count,ic,cem,echo_count)
 
+    def request_serial_errors(self):
+        req=self.GBPCMD_REQ_SERIAL_ERRORS
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if len(rep) != self.GBPCMD_REQ_SERIAL_ERRORS_REPLY_SIZE:
+            print("test result bad 2")
+            return (0,0)
+        if self.GBPCMD_REQ_SERIAL_ERRORS != rep[0:1]:
+            print("test result bad 1")
+            return (0,0)
+        # overrun is bytes lost in the USART, dropped is bytes lost
+        # because the input ring was full
+        overrun=(rep[1]<<8)|rep[2]
+        dropped=(rep[3]<<8)|rep[4]
+        return (overrun,dropped)
+
+    # Return (queue bytes, serial input bytes, max v2 data bytes) or
+    # None if the device doesn't say.
+    def request_capacity(self):
+        req=self.GBPCMD_REQ_CAPACITY
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if len(rep) != self.GBPCMD_REQ_CAPACITY_REPLY_SIZE:
+            return None
+        if self.GBPCMD_REQ_CAPACITY != rep[0:1]:
+            return None
+        return ((rep[1]<<8)|rep[2],rep[3],rep[4])
+
+    def request_set_baud(self,baud):
+        req=bytearray(self.GBPCMD_REQ_SET_BAUD)
+        req.append((baud>>24)&0xff)
+        req.append((baud>>16)&0xff)
+        req.append((baud>>8)&0xff)
+        req.append(baud&0xff)
+        #print(f"req=[{req}]")
+        # Don't retry, a retry would arrive after the device has switched.
+        rep=self.RequestNoRetry(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        return True
+
+    def credits_request(self,on):
+        req=bytearray(self.GBPCMD_REQ_SET_CREDITS)
+        req.append(1 if on else 0)
+        return req
+
+    def request_set_checksum(self,mode):
+        req=bytearray(self.GBPCMD_REQ_SET_CHECKSUM)
+        req.append(mode)
+        #print(f"req=[{req}]")
+        # The reply uses the old checksum. Don't retry, if only the reply
+        # was lost the device has already switched.
+        rep=self.RequestNoRetry(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        return True
+
+    # Time the device's schedule by source, GB_TICK_TIMER or
+    # GB_TICK_USB_FRAMES. Frames line report changes up with the host's
+    # polls. Older firmware or a build without frame events says no.
+    def request_set_tick(self,source):
+        req=bytearray(self.GBPCMD_REQ_SET_TICK)
+        req.append(source)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        # The tick rate may have changed.
+        self.clock_samples=[]
+        self.clock_rate=1000.0
+        return True
+
+    # Durations in later requests are in units, GB_UNITS_MSEC or
+    # GB_UNITS_100USEC. The msec arguments of the functions here are then
+    # in those units too. Elements already queued keep theirs.
+    def request_set_units(self,units):
+        req=bytearray(self.GBPCMD_REQ_SET_UNITS)
+        req.append(units)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        self.duration_units=units
+        return True
+
+    # How the device answers the host's polls, GB_REPORT_ECHO or
+    # GB_REPORT_EVERY_POLL.
+    def request_set_report_mode(self,mode):
+        req=bytearray(self.GBPCMD_REQ_SET_REPORT_MODE)
+        req.append(mode)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        return True
+
+    # Returns a dict of how the reports reached the host, or None. The
+    # first delivery times are in usec from the change to when the host
+    # took it. clear starts the counts over.
+    def request_report_stats(self,clear=False):
+        req=bytearray(self.GBPCMD_REQ_REPORT_STATS)
+        req.append(1 if clear else 0)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if len(rep) != self.GBPCMD_REQ_REPORT_STATS_REPLY_SIZE:
+            return None
+        if self.GBPCMD_REQ_REPORT_STATS != rep[0:1]:
+            return None
+        stats={}
+        stats['reports']=(rep[1]<<8)|rep[2]
+        stats['delivered']=(rep[3]<<8)|rep[4]
+        stats['current_count']=rep[5]
+        stats['previous_count']=rep[6]
+        stats['last_first_usec']=(rep[7]<<8)|rep[8]
+        stats['max_first_usec']=(rep[9]<<8)|rep[10]
+        stats['sum_first_usec']=(rep[11]<<24)|(rep[12]<<16)|(rep[13]<<8)|rep[14]
+        if stats['delivered'] > 0:
+            stats['mean_first_usec']=stats['sum_first_usec']/stats['delivered']
+        else:
+            stats['mean_first_usec']=None
+        return stats
+
+    # Stream whole states in place of the queue, GB_STREAM_LATEST with
+    # stream() or GB_STREAM_JITTER with stream_timed(), or go back to the
+    # queue with GB_STREAM_OFF.
+    def request_stream_mode(self,mode):
+        req=bytearray(self.GBPCMD_REQ_STREAM_MODE)
+        req.append(int(mode))
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        return True
+
+    # Send the whole state. It goes out on the next poll, replacing any
+    # state the console hasn't got yet. Returns the sequence number of
+    # this state and of the last one the console got and its latency in
+    # usec, from its request reaching the device to the console taking
+    # it, or None.
+    def stream(self,buttons=0,hat=None,LX=None,LY=None,RX=None,RY=None):
+        (buttons,hat,LX,LY,RX,RY,msec)=self.element(buttons,hat,LX,LY,RX,RY)
+        sequence=self.stream_sequence
+        self.stream_sequence=(sequence+1)&0xff
+        req=bytearray(self.GBPCMD_REQ_STREAM)
+        req.append(sequence)
+        req.append(0xff&(buttons>>8))
+        req.append(0xff&buttons)
+        req.append(hat)
+        req.append(LX)
+        req.append(LY)
+        req.append(RX)
+        req.append(RY)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if len(rep) != self.GBPCMD_REQ_STREAM_REPLY_SIZE:
+            return None
+        if self.GBPCMD_REQ_STREAM != rep[0:1]:
+            return None
+        return (sequence,rep[1],(rep[2]<<8)|rep[3])
+
+    # Returns a dict of how the streamed states reached the console, or
+    # None. clear starts the counts over.
+    def request_stream_stats(self,clear=False):
+        req=bytearray(self.GBPCMD_REQ_STREAM_STATS)
+        req.append(1 if clear else 0)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if len(rep) != self.GBPCMD_REQ_STREAM_STATS_REPLY_SIZE:
+            return None
+        if self.GBPCMD_REQ_STREAM_STATS != rep[0:1]:
+            return None
+        stats={}
+        stats['updates']=(rep[1]<<8)|rep[2]
+        stats['delivered']=(rep[3]<<8)|rep[4]
+        stats['replaced']=(rep[5]<<8)|rep[6]
+        stats['last_sequence']=rep[7]
+        stats['last_latency_usec']=(rep[8]<<8)|rep[9]
+        stats['max_latency_usec']=(rep[10]<<8)|rep[11]
+        stats['sum_latency_usec']=(rep[12]<<24)|(rep[13]<<16)|(rep[14]<<8)|rep[15]
+        if stats['delivered'] > 0:
+            stats['mean_latency_usec']=stats['sum_latency_usec']/stats['delivered']
+        else:
+            stats['mean_latency_usec']=None
+        return stats
+
+    # Send a frame of a recording or a live feed with its time in msec,
+    # by default now. The device plays the frames with the spacing of
+    # their times, after a playout delay that follows the arrival
+    # jitter. Returns the frames buffered and the delay in msec, or None.
+    def stream_timed(self,buttons=0,hat=None,LX=None,LY=None,RX=None,RY=None,host_msec=None):
+        (buttons,hat,LX,LY,RX,RY,msec)=self.element(buttons,hat,LX,LY,RX,RY)
+        if host_msec is None:
+            host_msec=int(time.monotonic()*1000)
+        req=bytearray(self.GBPCMD_REQ_STREAM_TIMED)
+        req.append(0xff&(host_msec>>8))
+        req.append(0xff&host_msec)
+        req.append(0xff&(buttons>>8))
+        req.append(0xff&buttons)
+        req.append(hat)
+        req.append(LX)
+        req.append(LY)
+        req.append(RX)
+        req.append(RY)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if len(rep) != self.GBPCMD_REQ_STREAM_TIMED_REPLY_SIZE:
+            return None
+        if self.GBPCMD_REQ_STREAM_TIMED != rep[0:1]:
+            return None
+        return (rep[1],rep[2])
+
+    # Returns a dict of how the timed frames played out, or None. jitter
+    # is in msec. clear starts the counts over.
+    def request_jitter_stats(self,clear=False):
+        req=bytearray(self.GBPCMD_REQ_JITTER_STATS)
+        req.append(1 if clear else 0)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if len(rep) != self.GBPCMD_REQ_JITTER_STATS_REPLY_SIZE:
+            return None
+        if self.GBPCMD_REQ_JITTER_STATS != rep[0:1]:
+            return None
+        stats={}
+        stats['frames']=(rep[1]<<8)|rep[2]
+        stats['played']=(rep[3]<<8)|rep[4]
+        stats['late']=(rep[5]<<8)|rep[6]
+        stats['dropped']=(rep[7]<<8)|rep[8]
+        stats['overflow']=(rep[9]<<8)|rep[10]
+        stats['underruns']=(rep[11]<<8)|rep[12]
+        stats['jitter']=((rep[13]<<8)|rep[14])/16
+        stats['delay_msec']=rep[15]
+        stats['depth']=rep[16]
+        stats['max_depth']=rep[17]
+        return stats
+
+    # Start a motion the device works out every msec on stick,
+    # MOTION_LEFT or MOTION_RIGHT. params are the bytes after the type,
+    # see the stick_ functions.
+    def request_motion(self,stick,motion,params=b''):
+        req=bytearray(self.GBPCMD_REQ_MOTION)
+        req.append(stick)
+        req.append(motion)
+        req+=params
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        return True
+
+    # Have the device press buttons every period_msec, down for
+    # duty_percent of it, count times or until turbo_stop() if 0. It runs
+    # alongside the queue. period_msec is at least 2 and duty_percent 1
+    # to 99.
+    def request_turbo(self,buttons,period_msec,duty_percent=50,count=0):
+        period_msec=int(period_msec)
+        req=bytearray(self.GBPCMD_REQ_TURBO)
+        req.append(0xff&(buttons>>8))
+        req.append(0xff&buttons)
+        req.append(0xff&(period_msec>>8))
+        req.append(0xff&period_msec)
+        req.append(int(duty_percent))
+        req.append(0xff&(count>>8))
+        req.append(0xff&count)
+        #print(f"req=[{req}]")
+        rep=self.Request(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        return True
+
+    def turbo_stop(self,buttons=0xffff):
+        return self.request_turbo(buttons,0)
+
+    # elements is a list of tuples from element()
+    # Add elements to the end of the macro in slot, or with start
+    # replace it, all of them or none with one request. Durations are
+    # in the units set when they're stored.
+    def request_macro_write(self,slot,elements,start=False):
+        req=bytearray(self.GBPCMD_REQ_MACRO_WRITE)
+        req.append(slot)
+        req.append(self.GB_MACRO_START if start else 0)
+        req.append(len(elements))
+        for e in elements:
+            (buttons,hat,LX,LY,RX,RY,duration_msec)=e
+            req.append((0xff00&buttons)>>8) # Button high
+            req.append(0x00ff&buttons) # Button low
+            req.append(hat)
+            req.append(LX)
+            req.append(LY)
+            req.append(RX)
+            req.append(RY)
+            req.append((0xff00&duration_msec)>>8)
+            req.append(0x00ff&duration_msec)
+        #print(f"req=[{req}]")
+        rep=self.MacroRequest(lambda: self.RequestOnce(req))
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        return True
+
+    # Call send until its reply isn't GBPCMD_REP_BUSY, or for at most
+    # macro_busy_seconds, and return the reply.
+    def MacroRequest(self,send):
+        start=time.monotonic()
+        while True:
+            rep=send()
+            if self.GBPCMD_REP_BUSY != rep:
+                return rep
+            if time.monotonic()-start >= self.macro_busy_seconds:
+                return rep
+            time.sleep(self.macro_busy_poll_seconds)
+
+    # Returns the bytes each slot holds and a list of (elements,bytes)
+    # used in each slot, or None.
+    def request_macro_list(self):
+        req=self.GBPCMD_REQ_MACRO_LIST
+        #print(f"req=[{req}]")
+        rep=self.MacroRequest(lambda: self.Request(req))
+        #print(f"rep=[{rep}]")
+        if len(rep) < 4 or self.GBPCMD_REQ_MACRO_LIST != rep[0:1]:
+            return None
+        slots=rep[1]
+        if len(rep) != 4+4*slots:
+            return None
+        slot_bytes=(rep[2]<<8)|rep[3]
+        used=[]
+        for i in range(slots):
+            p=4+4*i
+            used.append(((rep[p]<<8)|rep[p+1],(rep[p+2]<<8)|rep[p+3]))
+        return (slot_bytes,used)
+
+    # Play the macro in slot after the current element, ahead of the
+    # queue.
+    def request_macro_play(self,slot):
+        req=bytearray(self.GBPCMD_REQ_MACRO_PLAY)
+        req.append(slot)
+        #print(f"req=[{req}]")
+        rep=self.MacroRequest(lambda: self.Request(req))
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            return False
+        return True
+
+    def macro_stop(self):
+        return self.request_macro_play(self.GB_MACRO_STOP)
+
     def request_test_alive(self):
         req=self.GBPCMD_REQ_TEST
         #print(f"req=[{req}]")
@@ -256,7 +1386,7 @@ class PacketSerial:
             req.append((0xff00&duration_msec)>>8);
             req.append(0x00ff&duration_msec);
         #print(f"req=[{req}]")
-        rep=self.Request(req)
+        rep=self.RequestOnce(req)
         #print(f"rep=[{rep}]")
         if self.GBPCMD_REP_SUCCESS != rep:
             print("test result bad")
@@ -281,7 +1411,7 @@ class PacketSerial:
             req.append((0xff00&duration_msec)>>8);
             req.append(0x00ff&duration_msec);
         #print(f"req=[{req}]")
-        rep=self.Request(req)
+        rep=self.RequestOnce(req)
         #print(f"rep=[{rep}]")
         if self.GBPCMD_REP_SUCCESS != rep:
             print("test result bad")
@@ -304,7 +1434,7 @@ class PacketSerial:
             req.append((0xff00&duration_msec)>>8);
             req.append(0x00ff&duration_msec);
         #print(f"req=[{req}]")
-        rep=self.Request(req)
+        rep=self.RequestOnce(req)
         #print(f"rep=[{rep}]")
         if self.GBPCMD_REP_SUCCESS != rep:
             print("test result bad")
@@ -320,7 +1450,7 @@ class PacketSerial:
             req.append((0xff00&duration_msec)>>8);
             req.append(0x00ff&duration_msec);
         #print(f"req=[{req}]")
-        rep=self.Request(req)
+        rep=self.RequestOnce(req)
         #print(f"rep=[{rep}]")
         if self.GBPCMD_REP_SUCCESS != rep:
             print("test result bad")
@@ -328,6 +1458,265 @@ class PacketSerial:
         #print("test result good")
         return True
 
+    # elements is a list of tuples from element()
+    # Queue all of elements or none of them with one request. This waits
+    # until the queue has room for all of them.
+    def request_batch(self,elements):
+        if len(elements) < 1:
+            return True
+        req=bytearray(self.GBPCMD_REQ_BATCH)
+        req.append(len(elements))
+        for e in elements:
+            (buttons,hat,LX,LY,RX,RY,duration_msec)=e
+            req.append((0xff00&buttons)>>8) # Button high
+            req.append(0x00ff&buttons) # Button low
+            req.append(hat)
+            req.append(LX)
+            req.append(LY)
+            req.append(RX)
+            req.append(RY)
+            req.append((0xff00&duration_msec)>>8)
+            req.append(0x00ff&duration_msec)
+        #print(f"req=[{req}]")
+        rep=self.RequestOnce(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            print("test result bad")
+            return False
+        return True
+
+    # timed is a list of (tick,element) tuples, element from element()
+    # Queue elements that each start at tick on the device clock, all
+    # of them or none with one request.
+    def request_at(self,timed):
+        if len(timed) < 1:
+            return True
+        req=bytearray(self.GBPCMD_REQ_AT)
+        req.append(len(timed))
+        for (tick,e) in timed:
+            (buttons,hat,LX,LY,RX,RY,duration_msec)=e
+            tick&=0xffffffff
+            req.append((0xff000000&tick)>>24)
+            req.append((0x00ff0000&tick)>>16)
+            req.append((0x0000ff00&tick)>>8)
+            req.append(0x000000ff&tick)
+            req.append((0xff00&buttons)>>8) # Button high
+            req.append(0x00ff&buttons) # Button low
+            req.append(hat)
+            req.append(LX)
+            req.append(LY)
+            req.append(RX)
+            req.append(RY)
+            req.append((0xff00&duration_msec)>>8)
+            req.append(0x00ff&duration_msec)
+        #print(f"req=[{req}]")
+        rep=self.RequestOnce(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            print("test result bad")
+            return False
+        return True
+
+    def request_time(self):
+        """One timestamp echo. Returns (host send seconds, device receive
+        tick, device reply tick, host receive seconds) or None."""
+        t0=time.monotonic()
+        rep=self.RequestNoRetry(self.GBPCMD_REQ_TIME)
+        t3=time.monotonic()
+        if len(rep) != self.GBPCMD_REQ_TIME_REPLY_SIZE:
+            return None
+        if self.GBPCMD_REQ_TIME != rep[0:1]:
+            return None
+        rx=(rep[1]<<24)|(rep[2]<<16)|(rep[3]<<8)|rep[4]
+        tx=(rep[5]<<24)|(rep[6]<<16)|(rep[7]<<8)|rep[8]
+        drift=(rep[9]<<8)|rep[10]
+        if drift >= 0x8000:
+            drift-=0x10000
+        self.device_drift_ppm=None if self.DRIFT_UNKNOWN == drift else drift
+        return (t0,rx,tx,t3)
+
+    def UnwrapTicks(self,tick):
+        """Extend a 32 bit device tick past the wrap every 49 days."""
+        if self.clock_last_tick is not None and tick < self.clock_last_tick-(1<<31):
+            self.clock_wraps+=1
+        self.clock_last_tick=tick
+        return tick+(self.clock_wraps<<32)
+
+    def ClockSample(self):
+        """Take one clock sample and refit. Returns False if the
+        exchange failed."""
+        r=self.request_time()
+        if r is None:
+            return False
+        (t0,rx,tx,t3)=r
+        # The receive tick is stamped when the request has all arrived
+        # and the reply tick before the reply goes out, so take their
+        # time on the wire out of the round trip. What's left is taken
+        # as the same each way.
+        t0+=self.WireSeconds(self.GBPCMD_REQ_TIME)
+        extra=self.GB_CREDITS_SIZE if self.use_credits and 2 == self.protocol else 0
+        t3-=self.WireSeconds(bytes(self.GBPCMD_REQ_TIME_REPLY_SIZE+extra))
+        rx=self.UnwrapTicks(rx)
+        tx=self.UnwrapTicks(tx)
+        # A tick is read somewhere within its millisecond.
+        device=(rx+tx)/2+0.5
+        host=(t0+t3)/2
+        delay=(t3-t0)-(tx-rx)/self.clock_rate
+        self.clock_samples.append((host,device,delay))
+        if len(self.clock_samples) > self.clock_max_samples:
+            self.clock_samples.pop(0)
+        self.FitClock()
+        return True
+
+    def FitLine(self,points):
+        """Least squares rate through (host,device) points, or None if
+        they don't span enough time to trust."""
+        if len(points) < 2:
+            return None
+        span=max(h for (h,t) in points)-min(h for (h,t) in points)
+        if span < self.clock_min_span_seconds:
+            return None
+        hm=sum(h for (h,t) in points)/len(points)
+        tm=sum(t for (h,t) in points)/len(points)
+        num=sum((h-hm)*(t-tm) for (h,t) in points)
+        den=sum((h-hm)*(h-hm) for (h,t) in points)
+        return num/den
+
+    def FitClock(self):
+        """Fit device ticks against host seconds. Delay only ever adds
+        error, so the offset comes from the samples that had close to
+        the least delay. The rate comes from them too if they span
+        enough time, otherwise from all of the samples."""
+        best=min(d for (h,t,d) in self.clock_samples)
+        good=[(h,t) for (h,t,d) in self.clock_samples if d <= best+self.clock_delay_slack_seconds]
+        rate=self.FitLine(good)
+        if rate is None:
+            rate=self.FitLine([(h,t) for (h,t,d) in self.clock_samples])
+        if rate is not None:
+            self.clock_rate=rate
+        hm=sum(h for (h,t) in good)/len(good)
+        self.clock_host_ref=hm
+        self.clock_device_ref=sum(t-(h-hm)*self.clock_rate for (h,t) in good)/len(good)
+
+    def SyncClock(self,samples=8,interval_seconds=0.05):
+        """Take several samples, for a first fit or to tighten it."""
+        good=0
+        for i in range(samples):
+            if self.ClockSample():
+                good+=1
+            if i+1 < samples:
+                time.sleep(interval_seconds)
+        return good > 0
+
+    def SyncClockIfDue(self):
+        """Keep the fit current, sampling at most every
+        clock_sync_seconds."""
+        if len(self.clock_samples) < 1:
+            return self.SyncClock()
+        if time.monotonic()-self.clock_samples[-1][0] >= self.clock_sync_seconds:
+            return self.ClockSample()
+        return True
+
+    def ClockDriftPPM(self):
+        """How fast the device clock runs against the host, in parts
+        per million."""
+        return (self.clock_rate/1000.0-1.0)*1e6
+
+    def HostToDevice(self,t):
+        """Map host time.monotonic() seconds to fractional device ticks,
+        unwrapped."""
+        return self.clock_device_ref+(t-self.clock_host_ref)*self.clock_rate
+
+    def DeviceToHost(self,ticks):
+        """Map unwrapped device ticks to host time.monotonic() seconds."""
+        return self.clock_host_ref+(ticks-self.clock_device_ref)/self.clock_rate
+
+    # The device tick that interrupt_count reaches at host time t, by
+    # default now, ready for request_at() and schedule().
+    def device_ticks_at(self,t=None):
+        self.SyncClockIfDue()
+        if t is None:
+            t=time.monotonic()
+        return int(math.floor(self.HostToDevice(t)))&0xffffffff
+
+    # The host time.monotonic() at which interrupt_count reached ticks,
+    # a 32 bit tick from the device such as a receive tick.
+    def host_time_at(self,ticks):
+        self.SyncClockIfDue()
+        # Take the wrap closest to the last sample.
+        base=self.clock_last_tick+(self.clock_wraps<<32)
+        d=((ticks-base+(1<<31))&0xffffffff)-(1<<31)
+        return self.DeviceToHost(base+d)
+
+    # The device clock, in ticks of about a millisecond.
+    def request_device_ticks(self):
+        (flags,head,tail,count,ic,cem,echo_count)=self.request_query_state()
+        return ic
+
+    # elements is a list of tuples from element()
+    # Pin each of elements to the tick it should start at if they ran
+    # one after another from start_tick. Sent with send_at() they keep
+    # that timing however long the script runs.
+    def schedule(self,elements,start_tick):
+        timed=[]
+        tick=start_tick
+        for e in elements:
+            timed.append((tick&0xffffffff,e))
+            tick+=e[6]
+        return timed
+
+    # timed is a list of (tick,element) tuples, as from schedule()
+    # Queue timed in as few requests as fit.
+    def send_at(self,timed):
+        if 2 == self.protocol:
+            n=self.at_max_elements
+        else:
+            n=1
+        i=0
+        while i < len(timed):
+            if not self.WaitCredits(self.ElementSize(timed[i][1],at=True)):
+                return False
+            chunk=[timed[i]]
+            cost=self.ElementSize(timed[i][1],at=True)
+            while len(chunk) < n and i+len(chunk) < len(timed):
+                t=timed[i+len(chunk)]
+                cost+=self.ElementSize(t[1],at=True)
+                if self.queue_credits is not None and cost > self.queue_credits:
+                    break
+                chunk.append(t)
+            if not self.request_at(chunk):
+                return False
+            i+=len(chunk)
+        return True
+
+    # elements is a list of tuples from channel_element()
+    # Add all of elements to channel or none of them with one request.
+    # This waits until the channel has room for all of them.
+    def request_channel(self,channel,elements):
+        if len(elements) < 1:
+            return True
+        if not self.WaitChannelCredits(channel,len(elements)):
+            return False
+        req=bytearray(self.GBPCMD_REQ_CHANNEL)
+        req.append(channel)
+        req.append(len(elements))
+        for e in elements:
+            (value,duration_msec,release_msec)=e
+            req.append((0xff00&value)>>8)
+            req.append(0x00ff&value)
+            req.append((0xff00&duration_msec)>>8)
+            req.append(0x00ff&duration_msec)
+            req.append((0xff00&release_msec)>>8)
+            req.append(0x00ff&release_msec)
+        #print(f"req=[{req}]")
+        rep=self.RequestOnce(req)
+        #print(f"rep=[{rep}]")
+        if self.GBPCMD_REP_SUCCESS != rep:
+            print("test result bad")
+            return False
+        self.channel_credits[channel]-=len(elements)
+        return True
+
     def request_clear_state(self):
         req=self.GBPCMD_REQ_CLEAR_STATE;
         #print(f"req=[{req}]")
@@ -340,6 +1729,121 @@ class PacketSerial:
 
     # convenience functions
 
+    # One queue element, the report fields and how long they're held.
+    def element(self,buttons=0,hat=None,LX=None,LY=None,RX=None,RY=None,msec=0):
+        if hat is None:
+            hat=self.HAT_CENTER
+        if LX is None:
+            LX=self.STICK_CENTER
+        if LY is None:
+            LY=self.STICK_CENTER
+        if RX is None:
+            RX=self.STICK_CENTER
+        if RY is None:
+            RY=self.STICK_CENTER
+        return (buttons,hat,LX,LY,RX,RY,int(msec))
+
+    # The two elements of a press, down and then released, like the
+    # device makes for request_press_buttons() and the others. The
+    # release is held for wait_msec, time for the console to react
+    # before the next element. The device keeps both in one element.
+    def press_elements(self,buttons=0,hat=None,LX=None,LY=None,RX=None,RY=None,msec=0,wait_msec=0):
+        if msec <= 0:
+            msec=self.DEFAULT_PRESS_MSEC
+        return [self.element(buttons,hat,LX,LY,RX,RY,msec),self.element(msec=wait_msec)]
+
+    # elements is a list of tuples from element()
+    # Queue elements in as few requests as fit, each no bigger than the
+    # room the device has, so the queue is kept full without overflowing.
+    def send_batch(self,elements):
+        if 2 == self.protocol:
+            n=self.batch_max_elements
+        else:
+            n=1
+        i=0
+        while i < len(elements):
+            if not self.WaitCredits(self.ElementSize(elements[i])):
+                return False
+            # As many elements as fit in a packet and in the queue.
+            chunk=[elements[i]]
+            while len(chunk) < n and i+len(chunk) < len(elements):
+                e=elements[i+len(chunk)]
+                if self.queue_credits is not None and self.BatchCost(chunk+[e]) > self.queue_credits:
+                    break
+                chunk.append(e)
+            if not self.request_batch(chunk):
+                return False
+            i+=len(chunk)
+        return True
+
+    # elements is a list of tuples from element()
+    # Store elements as the macro in slot, replacing what was there, in
+    # as many requests as it takes. It stays on the device to be played
+    # with request_macro_play(). If it doesn't fit the slot is left
+    # empty.
+    def store_macro(self,slot,elements):
+        if 2 == self.protocol:
+            n=self.macro_max_elements
+        else:
+            n=1
+        if len(elements) < 1:
+            return self.request_macro_write(slot,[],True)
+        i=0
+        while i < len(elements):
+            chunk=elements[i:i+n]
+            if not self.request_macro_write(slot,chunk,0 == i):
+                # Don't leave part of it to be played.
+                self.request_macro_write(slot,[],True)
+                return False
+            i+=len(chunk)
+        return True
+
+    # One channel element, held for msec and then released for
+    # release_msec. For the stick channels use stick_value().
+    def channel_element(self,value,msec,release_msec=0):
+        return (value,int(msec),int(release_msec))
+
+    def stick_value(self,X,Y):
+        return (X<<8)|Y
+
+    # elements is a list of tuples from channel_element()
+    # Add elements to channel in as few requests as fit.
+    def send_channel(self,channel,elements):
+        if 2 == self.protocol:
+            # length, request id, prefix, channel and count
+            n=(self.SP2_MAX_DATA_SIZE_SMALL-7)//self.GB_CHANNEL_ELEMENT_SIZE
+        else:
+            n=1
+        i=0
+        while i < len(elements):
+            if not self.WaitChannelCredits(channel,1):
+                return False
+            chunk=elements[i:i+min(n,self.channel_credits[channel])]
+            if not self.request_channel(channel,chunk):
+                return False
+            i+=len(chunk)
+        return True
+
+    # Hold the left stick for msec on its own channel.
+    def hold_left_joy(self,LX,LY,msec):
+        e=self.channel_element(self.stick_value(LX,LY),msec)
+        return self.request_channel(self.CHANNEL_LEFT,[e])
+
+    # Hold the right stick for msec on its own channel.
+    def hold_right_joy(self,RX,RY,msec):
+        e=self.channel_element(self.stick_value(RX,RY),msec)
+        return self.request_channel(self.CHANNEL_RIGHT,[e])
+
+    # Press buttons count times on their own channel, each press held
+    # msec and followed by release_msec released.
+    def tap_buttons(self,buttons,count=1,msec=0,release_msec=0):
+        if msec <= 0:
+            msec=self.DEFAULT_PRESS_MSEC
+        if release_msec <= 0:
+            release_msec=self.DEFAULT_PRESS_MSEC
+        e=self.channel_element(buttons,msec,release_msec)
+        return self.send_channel(self.CHANNEL_BUTTONS,[e]*count)
+
     # heading= 0=up/north, 90=right/east, 180=down/south, 270=left/west
     # extent= 0.0= 0% nothing/center, 1.0= 100% full/max
     def left_joy_heading(self,heading,extent,duration_msec):
@@ -364,6 +1868,39 @@ class PacketSerial:
         dY=self.STICK_CENTER-int(round(fcos*radius))
         return self.request_move_right_joy(dX,dY,duration_msec)
 
+    # Move stick from X0,Y0 to X1,Y1 in a straight line over msec, at
+    # one speed or easing in and out. The stick goes back to the queue
+    # after, or holds X1,Y1 until stick_stop() if msec is 0.
+    def stick_ramp(self,stick,X0,Y0,X1,Y1,msec,ease=False):
+        motion=self.GB_MOTION_EASE if ease else self.GB_MOTION_RAMP
+        msec=int(msec)
+        params=bytes([X0,Y0,X1,Y1,0xff&(msec>>8),0xff&msec])
+        return self.request_motion(stick,motion,params)
+
+    # Move stick round the center from heading at extent, like
+    # left_joy_heading(), turning degrees_per_second, negative for
+    # anticlockwise. A circle that runs until stick_stop() if msec is 0.
+    def stick_arc(self,stick,heading,extent,degrees_per_second,msec=0):
+        angle=int(round((heading%360)*65536/360))&0xffff
+        radius=int(round(extent*(self.STICK_MAX-self.STICK_CENTER)))
+        speed=int(round(degrees_per_second))&0xffff
+        msec=int(msec)
+        params=bytes([angle>>8,0xff&angle,radius,speed>>8,0xff&speed,0xff&(msec>>8),0xff&msec])
+        return self.request_motion(stick,self.GB_MOTION_ARC,params)
+
+    # Sweep stick from one heading to another over msec, the short way
+    # round unless clockwise says which.
+    def stick_sweep(self,stick,from_heading,to_heading,extent,msec,clockwise=None):
+        turn=(to_heading-from_heading)%360
+        if clockwise is None:
+            clockwise=(turn <= 180)
+        if not clockwise:
+            turn=turn-360
+        return self.stick_arc(stick,from_heading,extent,turn*1000/msec,msec)
+
+    def stick_stop(self,stick):
+        return self.request_motion(stick,self.GB_MOTION_NONE)
+
     def press_Y(self,msec=0):
         return self.request_press_buttons(self.SWITCH_Y,msec)
 
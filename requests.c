@@ -3,6 +3,8 @@ Copyright 2021 by angry-kitten
 Serial packet support written for gamebot-serial.
 */
 
+#include <util/atomic.h>
+
 #include <LUFA/Drivers/USB/USB.h>
 #include <LUFA/Drivers/Peripheral/Serial.h>
 #include <LUFA/Platform/Platform.h>
@@ -10,8 +12,18 @@ Serial packet support written for gamebot-serial.
 #include "gamebotserial.h"
 #include "packetserial.h"
 #include "cmdqueue.h"
+#include "channel.h"
+#include "stream.h"
+#include "motion.h"
+#include "turbo.h"
+#include "macro.h"
+#include "timebase.h"
 
 uint16_t default_press_duration_msec=DEFAULT_BUTTON_PRESS_DURATION;
+uint8_t duration_units=GB_UNITS_MSEC; // for durations given in requests
+
+recent_request_t recent_requests[RECENT_REQUEST_COUNT];
+uint8_t recent_request_next=0; // slot to reuse next
 
 void ReplyByte(uint8_t b)
 {
@@ -38,6 +50,11 @@ void ReplyOverflow(void)
     ReplyByte(GBPCMD_REP_OVERFLOW);
 }
 
+void ReplyBusy(void)
+{
+    ReplyByte(GBPCMD_REP_BUSY);
+}
+
 
 void RequestQueryState(uint8_t *rp, uint8_t rl)
 {
@@ -51,16 +68,24 @@ void RequestQueryState(uint8_t *rp, uint8_t rl)
     {
         reply[1]|=GB_FLAGS_CONFIGURED;
     }
-
-    reply[2]=cmdq.head;
-    reply[3]=cmdq.tail;
-    reply[4]=cmdq.count;
-    uint32_t ic=interrupt_count;
+    if( TickFromFrames() )
+    {
+        reply[1]|=GB_FLAGS_USB_FRAMES;
+    }
+#if ! GB_HAVE_CHANNELS
+    reply[1]|=GB_FLAGS_SMALL;
+#endif
+
+    // The low bytes, the queue is packed so these count bytes.
+    reply[2]=0xff&cmdq.head;
+    reply[3]=0xff&cmdq.tail;
+    reply[4]=(cmdq.count > 0xff)?0xff:cmdq.count;
+    uint32_t ic=TickNow();
     reply[5]=0xff&(ic>>24);
     reply[6]=0xff&(ic>>16);
     reply[7]=0xff&(ic>>8);
     reply[8]=0xff&ic;
-    uint32_t cem=cmd_elapsed_msec;
+    uint32_t cem=CmdElapsedMSec();
     reply[9]=0xff&(cem>>24);
     reply[10]=0xff&(cem>>16);
     reply[11]=0xff&(cem>>8);
@@ -120,27 +145,18 @@ void RequestPressAll(uint8_t *rp, uint8_t rl)
     if( rl < 8 )
     {
         ReplyError();
+        return;
     }
     if( rl > 10 )
     {
         ReplyError();
-    }
-
-    uint8_t f=CMDQueueFree();
-    if( f < 2 )
-    {
-        ReplyOverflow();
         return;
     }
 
     // Set up the down strokes.
-    cmdqueue_element_t *pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
-    {
-        ReplyOverflow();
-        return;
-    }
+    cmdqueue_element_t e;
+    cmdqueue_element_t *pe=&e;
+    SetElementDefaultState(pe);
 
     // LX, + is right, - is left
     // LY, + is down, - is up
@@ -160,6 +176,7 @@ void RequestPressAll(uint8_t *rp, uint8_t rl)
 
     if( rl >= 9 )
     {
+        pe->fine=(GB_UNITS_100USEC == duration_units);
         pe->duration_msec = rp[8]<<8;
         if( rl >= 10 )
         {
@@ -173,20 +190,17 @@ void RequestPressAll(uint8_t *rp, uint8_t rl)
 
     // Set up the up strokes.
     // Since this is a full button press, we now need
-    // to release the buttons.
+    // to release the buttons. The same element does that
+    // when the down strokes are done.
+    pe->release=true;
+    pe->release_msec=0;
 
-    pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
+    if( ! CMDQueueAdd(pe) )
     {
-        // This shouldn't happen.
         ReplyOverflow();
         return;
     }
 
-    // It's already initialized to its default state so
-    // we don't have to do anything.
-
     ReplySuccess();
 }
 
@@ -195,27 +209,18 @@ void RequestPressButtons(uint8_t *rp, uint8_t rl)
     if( rl < 3 )
     {
         ReplyError();
+        return;
     }
     if( rl > 5 )
     {
         ReplyError();
-    }
-
-    uint8_t f=CMDQueueFree();
-    if( f < 2 )
-    {
-        ReplyOverflow();
         return;
     }
 
     // Set up the down strokes.
-    cmdqueue_element_t *pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
-    {
-        ReplyOverflow();
-        return;
-    }
+    cmdqueue_element_t e;
+    cmdqueue_element_t *pe=&e;
+    SetElementDefaultState(pe);
 
     // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
     // 0       1            2           3          4
@@ -226,6 +231,7 @@ void RequestPressButtons(uint8_t *rp, uint8_t rl)
 
     if( rl >= 4 )
     {
+        pe->fine=(GB_UNITS_100USEC == duration_units);
         pe->duration_msec = rp[3]<<8;
         if( rl >= 5 )
         {
@@ -239,20 +245,17 @@ void RequestPressButtons(uint8_t *rp, uint8_t rl)
 
     // Set up the up strokes.
     // Since this is a full button press, we now need
-    // to release the buttons.
+    // to release the buttons. The same element does that
+    // when the down strokes are done.
+    pe->release=true;
+    pe->release_msec=0;
 
-    pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
+    if( ! CMDQueueAdd(pe) )
     {
-        // This shouldn't happen.
         ReplyOverflow();
         return;
     }
 
-    // It's already initialized to its default state so
-    // we don't have to do anything.
-
     ReplySuccess();
 }
 
@@ -261,27 +264,18 @@ void RequestMoveLeftJoy(uint8_t *rp, uint8_t rl)
     if( rl < 3 )
     {
         ReplyError();
+        return;
     }
     if( rl > 5 )
     {
         ReplyError();
-    }
-
-    uint8_t f=CMDQueueFree();
-    if( f < 2 )
-    {
-        ReplyOverflow();
         return;
     }
 
     // Set up the down strokes.
-    cmdqueue_element_t *pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
-    {
-        ReplyOverflow();
-        return;
-    }
+    cmdqueue_element_t e;
+    cmdqueue_element_t *pe=&e;
+    SetElementDefaultState(pe);
 
     // LX, + is right, - is left
     // LY, + is down, - is up
@@ -294,6 +288,7 @@ void RequestMoveLeftJoy(uint8_t *rp, uint8_t rl)
 
     if( rl >= 4 )
     {
+        pe->fine=(GB_UNITS_100USEC == duration_units);
         pe->duration_msec = rp[3]<<8;
         if( rl >= 5 )
         {
@@ -307,20 +302,17 @@ void RequestMoveLeftJoy(uint8_t *rp, uint8_t rl)
 
     // Set up the up strokes.
     // Since this is a full button press, we now need
-    // to release the buttons.
+    // to release the buttons. The same element does that
+    // when the down strokes are done.
+    pe->release=true;
+    pe->release_msec=0;
 
-    pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
+    if( ! CMDQueueAdd(pe) )
     {
-        // This shouldn't happen.
         ReplyOverflow();
         return;
     }
 
-    // It's already initialized to its default state so
-    // we don't have to do anything.
-
     ReplySuccess();
 }
 
@@ -329,27 +321,18 @@ void RequestMoveRightJoy(uint8_t *rp, uint8_t rl)
     if( rl < 3 )
     {
         ReplyError();
+        return;
     }
     if( rl > 5 )
     {
         ReplyError();
-    }
-
-    uint8_t f=CMDQueueFree();
-    if( f < 2 )
-    {
-        ReplyOverflow();
         return;
     }
 
     // Set up the down strokes.
-    cmdqueue_element_t *pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
-    {
-        ReplyOverflow();
-        return;
-    }
+    cmdqueue_element_t e;
+    cmdqueue_element_t *pe=&e;
+    SetElementDefaultState(pe);
 
     // RX, + is right, - is left
     // RY, + is down, - is up
@@ -362,6 +345,7 @@ void RequestMoveRightJoy(uint8_t *rp, uint8_t rl)
 
     if( rl >= 4 )
     {
+        pe->fine=(GB_UNITS_100USEC == duration_units);
         pe->duration_msec = rp[3]<<8;
         if( rl >= 5 )
         {
@@ -375,20 +359,17 @@ void RequestMoveRightJoy(uint8_t *rp, uint8_t rl)
 
     // Set up the up strokes.
     // Since this is a full button press, we now need
-    // to release the buttons.
+    // to release the buttons. The same element does that
+    // when the down strokes are done.
+    pe->release=true;
+    pe->release_msec=0;
 
-    pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
+    if( ! CMDQueueAdd(pe) )
     {
-        // This shouldn't happen.
         ReplyOverflow();
         return;
     }
 
-    // It's already initialized to its default state so
-    // we don't have to do anything.
-
     ReplySuccess();
 }
 
@@ -397,27 +378,18 @@ void RequestPressHat(uint8_t *rp, uint8_t rl)
     if( rl < 2 )
     {
         ReplyError();
+        return;
     }
     if( rl > 4 )
     {
         ReplyError();
-    }
-
-    uint8_t f=CMDQueueFree();
-    if( f < 2 )
-    {
-        ReplyOverflow();
         return;
     }
 
     // Set up the down strokes.
-    cmdqueue_element_t *pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
-    {
-        ReplyOverflow();
-        return;
-    }
+    cmdqueue_element_t e;
+    cmdqueue_element_t *pe=&e;
+    SetElementDefaultState(pe);
 
     // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
     // 0       1    2          3
@@ -427,6 +399,7 @@ void RequestPressHat(uint8_t *rp, uint8_t rl)
 
     if( rl >= 3 )
     {
+        pe->fine=(GB_UNITS_100USEC == duration_units);
         pe->duration_msec = rp[2]<<8;
         if( rl >= 4 )
         {
@@ -440,27 +413,236 @@ void RequestPressHat(uint8_t *rp, uint8_t rl)
 
     // Set up the up strokes.
     // Since this is a full button press, we now need
-    // to release the buttons.
+    // to release the buttons. The same element does that
+    // when the down strokes are done.
+    pe->release=true;
+    pe->release_msec=0;
+
+    if( ! CMDQueueAdd(pe) )
+    {
+        ReplyOverflow();
+        return;
+    }
+
+    ReplySuccess();
+}
+
+bool BatchElementIsRelease(uint8_t *ep)
+{
+    return 0 == ep[0] && 0 == ep[1] && HAT_CENTER == ep[2]
+        && STICK_CENTER == ep[3] && STICK_CENTER == ep[4]
+        && STICK_CENTER == ep[5] && STICK_CENTER == ep[6];
+}
+
+// Unpack the batch element at ep into pe. When the next one is a
+// release it's folded into pe. Returns how many batch elements were
+// used out of the left remaining.
+uint8_t BatchElement(cmdqueue_element_t *pe, uint8_t *ep, uint8_t left)
+{
+    SetElementDefaultState(pe);
+
+    // 0            1           2    3   4   5   6   7          8
+    // Button high, Button low, Hat, LX, LY, RX, RY, MSec high, MSec low
+    pe->i.Button = ep[0]<<8;
+    pe->i.Button |= ep[1];
+    pe->i.HAT = ep[2];
+    pe->i.LX = ep[3];
+    pe->i.LY = ep[4];
+    pe->i.RX = ep[5];
+    pe->i.RY = ep[6];
+    pe->duration_msec = ep[7]<<8;
+    pe->duration_msec |= ep[8];
+    pe->fine=(GB_UNITS_100USEC == duration_units);
+
+    if( left < 2 )
+    {
+        return 1;
+    }
+    ep+=GB_BATCH_ELEMENT_SIZE;
+    uint16_t release_msec=(ep[7]<<8)|ep[8];
+    if( ! BatchElementIsRelease(ep) || release_msec > CMDQ_RELEASE_MAX_MSEC )
+    {
+        return 1;
+    }
+    pe->release=true;
+    pe->release_msec=release_msec;
+    return 2;
+}
+
+void RequestBatch(uint8_t *rp, uint8_t rl)
+{
+    // Queue several elements at once. Either all of them are added or,
+    // if there isn't room for all of them, none are. Unlike the press
+    // requests no release is added, send it as an element. A release
+    // right after another element shares its queue element.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1      2...
+    // Prefix, Count, Elements...
+    // Each element is
+    // 0            1           2    3   4   5   6   7          8
+    // Button high, Button low, Hat, LX, LY, RX, RY, MSec high, MSec low
+    if( rl < 2 )
+    {
+        ReplyError();
+        return;
+    }
+
+    uint8_t count=rp[1];
+    if( count < 1 || (rl-2) != ((uint16_t)count)*GB_BATCH_ELEMENT_SIZE )
+    {
+        ReplyError();
+        return;
+    }
+
+    // Unpack the elements once to size them and again to add them.
+    cmdqueue_element_t e;
+    uint16_t size=0;
+    uint8_t n=0;
+    while( n < count )
+    {
+        n+=BatchElement(&e,&(rp[2+n*GB_BATCH_ELEMENT_SIZE]),count-n);
+        size+=CMDQueueElementSize(&e);
+    }
+    if( size > CMDQueueFreeBytes() )
+    {
+        ReplyOverflow();
+        return;
+    }
+
+    n=0;
+    while( n < count )
+    {
+        n+=BatchElement(&e,&(rp[2+n*GB_BATCH_ELEMENT_SIZE]),count-n);
+        CMDQueueAdd(&e);
+    }
+
+    ReplySuccess();
+}
+
+void RequestAt(uint8_t *rp, uint8_t rl)
+{
+    // Queue elements that each start at an absolute time, in ticks of
+    // the device clock (see the query state reply), instead of after
+    // the element before them. Either all of them are added or, if
+    // there isn't room for all of them, none are.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1      2...
+    // Prefix, Count, Elements...
+    // Each element is the start tick then a batch element
+    // 0     1     2     3     4...
+    // Tick, Tick, Tick, Tick, Batch element...
+    if( rl < 2 )
+    {
+        ReplyError();
+        return;
+    }
+
+    uint8_t count=rp[1];
+    if( count < 1 || (rl-2) != ((uint16_t)count)*GB_AT_ELEMENT_SIZE )
+    {
+        ReplyError();
+        return;
+    }
+
+    cmdqueue_element_t e;
+    uint16_t size=0;
+    uint8_t *ep=&(rp[2]);
+    uint8_t n;
+    for(n=0;n<count;n++)
+    {
+        BatchElement(&e,&(ep[4]),1);
+        e.at=true;
+        size+=CMDQueueElementSize(&e);
+        ep+=GB_AT_ELEMENT_SIZE;
+    }
+    if( size > CMDQueueFreeBytes() )
+    {
+        ReplyOverflow();
+        return;
+    }
+
+    ep=&(rp[2]);
+    for(n=0;n<count;n++)
+    {
+        BatchElement(&e,&(ep[4]),1);
+        e.at=true;
+        e.at_tick=((uint32_t)ep[0])<<24;
+        e.at_tick|=((uint32_t)ep[1])<<16;
+        e.at_tick|=((uint32_t)ep[2])<<8;
+        e.at_tick|=ep[3];
+        CMDQueueAdd(&e);
+        ep+=GB_AT_ELEMENT_SIZE;
+    }
+
+    ReplySuccess();
+}
+
+#if GB_HAVE_CHANNELS
+void RequestChannel(uint8_t *rp, uint8_t rl)
+{
+    // Add elements to one channel's timeline, all of them or, if there
+    // isn't room, none. They run alongside the command queue.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1        2      3...
+    // Prefix, Channel, Count, Elements...
+    // Each element is
+    // 0           1          2          3         4              5
+    // Value high, Value low, MSec high, MSec low, Release high, Release low
+    if( rl < 3 || rp[1] >= CHANNEL_COUNT )
+    {
+        ReplyError();
+        return;
+    }
+
+    uint8_t c=rp[1];
+    uint8_t count=rp[2];
+    if( count < 1 || (rl-3) != ((uint16_t)count)*GB_CHANNEL_ELEMENT_SIZE )
+    {
+        ReplyError();
+        return;
+    }
 
-    pe=NULL;
-    CMDQueueAdd(&pe);
-    if( ! pe )
+    if( count > ChannelFree(c) )
     {
-        // This shouldn't happen.
         ReplyOverflow();
         return;
     }
 
-    // It's already initialized to its default state so
-    // we don't have to do anything.
+    uint8_t *ep=&(rp[3]);
+    uint8_t n;
+    for(n=0;n<count;n++)
+    {
+        channel_element_t e;
+        e.value=(ep[0]<<8)|ep[1];
+        e.duration_msec=(ep[2]<<8)|ep[3];
+        e.release_msec=(ep[4]<<8)|ep[5];
+        ChannelAdd(c,&e);
+        ep+=GB_CHANNEL_ELEMENT_SIZE;
+    }
 
     ReplySuccess();
 }
+#endif /* GB_HAVE_CHANNELS */
 
 void RequestClearState(uint8_t *rp, uint8_t rl)
 {
     CMDQueueClear_gpe();
     CMDQueueReset();
+#if GB_HAVE_CHANNELS
+    ChannelReset();
+#endif
+#if GB_HAVE_STREAM
+    StreamSetMode(GB_STREAM_OFF,&base_report);
+#endif
+#if GB_HAVE_MOTION
+    MotionReset();
+#endif
+#if GB_HAVE_TURBO
+    TurboReset();
+#endif
+#if GB_HAVE_MACRO
+    MacroStop();
+#endif
     ReplySuccess();
 }
 
@@ -474,6 +656,741 @@ void RequestReportPending(uint8_t *rp, uint8_t rl)
     ReplyError();
 }
 
+void RequestSerialErrors(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_SERIAL_ERRORS_REPLY_SIZE];
+    uint16_t overrun;
+    uint16_t dropped;
+
+    // The counters are updated by the receive interrupt.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        overrun=serial_rx_overrun_count;
+        dropped=serial_rx_drop_count;
+    }
+
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1             2            3             4
+    // Prefix, Overrun high, Overrun low, Dropped high, Dropped low
+    reply[0]=GBPCMD_REQ_SERIAL_ERRORS;
+    reply[1]=0xff&(overrun>>8);
+    reply[2]=0xff&overrun;
+    reply[3]=0xff&(dropped>>8);
+    reply[4]=0xff&dropped;
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+void RequestCapacity(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_CAPACITY_REPLY_SIZE];
+
+    // These are fixed when the firmware is built for a board.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1                 2                3                   4
+    // Prefix, Queue bytes high, Queue bytes low, Serial input bytes, Max v2 data bytes
+    reply[0]=GBPCMD_REQ_CAPACITY;
+    reply[1]=0xff&(CMDQUEUE_SIZE>>8);
+    reply[2]=0xff&CMDQUEUE_SIZE;
+    reply[3]=SERIAL_RING_SIZE;
+    reply[4]=SP2_MAX_DATA_SIZE;
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+void RequestTime(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_TIME_REPLY_SIZE];
+    uint32_t rx;
+    uint32_t tx;
+    int16_t drift=TimerDriftPPM();
+
+    // Timestamp echo for syncing the host's clock to interrupt_count.
+    // The receive tick is when the request's packet ended, the reply
+    // tick is when the reply is sent. The drift is how fast the timer
+    // runs against the USB frames in ppm, signed, or -32768 if unknown.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1...4         5...8       9           10
+    // Prefix, Receive tick, Reply tick, Drift high, Drift low
+    rx=serial_rx_end_tick;
+    tx=TickNow();
+    reply[0]=GBPCMD_REQ_TIME;
+    reply[1]=0xff&(rx>>24);
+    reply[2]=0xff&(rx>>16);
+    reply[3]=0xff&(rx>>8);
+    reply[4]=0xff&rx;
+    reply[5]=0xff&(tx>>24);
+    reply[6]=0xff&(tx>>16);
+    reply[7]=0xff&(tx>>8);
+    reply[8]=0xff&tx;
+    reply[9]=0xff&(((uint16_t)drift)>>8);
+    reply[10]=0xff&drift;
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+void RequestQueueFree(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_QUEUE_FREE_REPLY_SIZE];
+    uint16_t f=CMDQueueFreeBytes();
+
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1          2         3...
+    // Prefix, Free high, Free low, Free elements of each channel
+    // The channels show no room on boards without them.
+    reply[0]=GBPCMD_REQ_QUEUE_FREE;
+    reply[1]=0xff&(f>>8);
+    reply[2]=0xff&f;
+    uint8_t c;
+    for(c=0;c<CHANNEL_COUNT;c++)
+    {
+#if GB_HAVE_CHANNELS
+        reply[3+c]=ChannelFree(c);
+#else
+        reply[3+c]=0;
+#endif
+    }
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+void RequestSetBaud(uint8_t *rp, uint8_t rl)
+{
+    if( rl != 5 )
+    {
+        ReplyError();
+        return;
+    }
+
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1          2     3     4
+    // Prefix, Baud high, ..., ..., Baud low
+    uint32_t baud=((uint32_t)rp[1])<<24;
+    baud|=((uint32_t)rp[2])<<16;
+    baud|=((uint32_t)rp[3])<<8;
+    baud|=rp[4];
+
+    if( ! SerialRequestBaud(baud) )
+    {
+        ReplyError();
+        return;
+    }
+
+    // This reply goes out at the old rate. The switch happens after it
+    // has been sent.
+    ReplySuccess();
+}
+
+void RequestSetChecksum(uint8_t *rp, uint8_t rl)
+{
+    if( rl != 2 )
+    {
+        ReplyError();
+        return;
+    }
+
+    // 0       1
+    // Prefix, Mode
+    uint8_t mode=rp[1];
+    if( GB_CHECKSUM_LEGACY != mode && GB_CHECKSUM_CRC != mode )
+    {
+        ReplyError();
+        return;
+    }
+
+    // This reply still uses the old checksum.
+    ReplySuccess();
+    checksum_mode=mode;
+}
+
+void RequestSetTick(uint8_t *rp, uint8_t rl)
+{
+    if( rl != 2 )
+    {
+        ReplyError();
+        return;
+    }
+
+    // 0       1
+    // Prefix, Source
+    if( ! SetTickSource(rp[1]) )
+    {
+        ReplyError();
+        return;
+    }
+
+    ReplySuccess();
+}
+
+void RequestSetUnits(uint8_t *rp, uint8_t rl)
+{
+    if( rl != 2 )
+    {
+        ReplyError();
+        return;
+    }
+
+    // The units of durations in later requests. Elements already queued
+    // keep theirs.
+    // 0       1
+    // Prefix, Units
+    uint8_t units=rp[1];
+    if( GB_UNITS_MSEC != units && GB_UNITS_100USEC != units )
+    {
+        ReplyError();
+        return;
+    }
+    duration_units=units;
+
+    ReplySuccess();
+}
+
+void RequestSetReportMode(uint8_t *rp, uint8_t rl)
+{
+    if( rl != 2 )
+    {
+        ReplyError();
+        return;
+    }
+
+    // 0       1
+    // Prefix, Mode
+    uint8_t mode=rp[1];
+    if( GB_REPORT_ECHO != mode && GB_REPORT_EVERY_POLL != mode )
+    {
+        ReplyError();
+        return;
+    }
+    report_mode=mode;
+
+    ReplySuccess();
+}
+
+void RequestReportStats(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_REPORT_STATS_REPLY_SIZE];
+
+    // A non-zero Clear starts the counts over after this reply.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1
+    // Prefix, Clear (optional)
+    // 0       1...2    3...4      5        6         7...8       9...10     11...14
+    // Prefix, Reports, Delivered, Current, Previous, Last first, Max first, Sum first
+    // The first delivery times are in usec.
+    reply[0]=GBPCMD_REQ_REPORT_STATS;
+    reply[1]=0xff&(report_stats.reports>>8);
+    reply[2]=0xff&report_stats.reports;
+    reply[3]=0xff&(report_stats.delivered>>8);
+    reply[4]=0xff&report_stats.delivered;
+    reply[5]=report_stats.current_count;
+    reply[6]=report_stats.previous_count;
+    reply[7]=0xff&(report_stats.last_first_usec>>8);
+    reply[8]=0xff&report_stats.last_first_usec;
+    reply[9]=0xff&(report_stats.max_first_usec>>8);
+    reply[10]=0xff&report_stats.max_first_usec;
+    reply[11]=0xff&(report_stats.sum_first_usec>>24);
+    reply[12]=0xff&(report_stats.sum_first_usec>>16);
+    reply[13]=0xff&(report_stats.sum_first_usec>>8);
+    reply[14]=0xff&report_stats.sum_first_usec;
+
+    if( rl >= 2 && 0 != rp[1] )
+    {
+        ReportStatsReset();
+    }
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+#if GB_HAVE_STREAM
+void RequestStreamMode(uint8_t *rp, uint8_t rl)
+{
+    if( rl != 2 )
+    {
+        ReplyError();
+        return;
+    }
+
+    // Start streaming from the current report, or go back to the queue.
+    // 0       1
+    // Prefix, Mode
+    if( ! StreamSetMode(rp[1],&base_report) )
+    {
+        ReplyError();
+        return;
+    }
+
+    ReplySuccess();
+}
+
+void RequestStream(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_STREAM_REPLY_SIZE];
+    uint32_t rx;
+
+    if( rl != GBPCMD_REQ_STREAM_SIZE || GB_STREAM_LATEST != stream_mode )
+    {
+        ReplyError();
+        return;
+    }
+
+    // The request's packet ended before the main loop got to it.
+    rx=serial_rx_end_usec;
+
+    // A whole state for the mailbox, it replaces any the host hasn't
+    // got yet. The reply is how long the last delivered state took from
+    // its packet ending to the host taking it, in usec.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1         2            3           4    5   6   7   8
+    // Prefix, Sequence, Button high, Button low, HAT, LX, LY, RX, RY
+    // 0       1                   2             3
+    // Prefix, Delivered sequence, Latency high, Latency low
+    USB_JoystickReport_Input_t r;
+    memset(&r,0,sizeof(r));
+    r.Button=(((uint16_t)rp[2])<<8)|rp[3];
+    r.HAT=rp[4];
+    r.LX=rp[5];
+    r.LY=rp[6];
+    r.RX=rp[7];
+    r.RY=rp[8];
+    StreamPut(&r,rp[1],rx);
+
+    reply[0]=GBPCMD_REQ_STREAM;
+    reply[1]=stream_stats.last_sequence;
+    reply[2]=0xff&(stream_stats.last_latency_usec>>8);
+    reply[3]=0xff&stream_stats.last_latency_usec;
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+void RequestStreamStats(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_STREAM_STATS_REPLY_SIZE];
+
+    // A non-zero Clear starts the counts over after this reply.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1
+    // Prefix, Clear (optional)
+    // 0       1...2    3...4      5...6     7              8...9         10...11      12...15
+    // Prefix, Updates, Delivered, Replaced, Last sequence, Last latency, Max latency, Sum latency
+    // The latencies are in usec.
+    reply[0]=GBPCMD_REQ_STREAM_STATS;
+    reply[1]=0xff&(stream_stats.updates>>8);
+    reply[2]=0xff&stream_stats.updates;
+    reply[3]=0xff&(stream_stats.delivered>>8);
+    reply[4]=0xff&stream_stats.delivered;
+    reply[5]=0xff&(stream_stats.replaced>>8);
+    reply[6]=0xff&stream_stats.replaced;
+    reply[7]=stream_stats.last_sequence;
+    reply[8]=0xff&(stream_stats.last_latency_usec>>8);
+    reply[9]=0xff&stream_stats.last_latency_usec;
+    reply[10]=0xff&(stream_stats.max_latency_usec>>8);
+    reply[11]=0xff&stream_stats.max_latency_usec;
+    reply[12]=0xff&(stream_stats.sum_latency_usec>>24);
+    reply[13]=0xff&(stream_stats.sum_latency_usec>>16);
+    reply[14]=0xff&(stream_stats.sum_latency_usec>>8);
+    reply[15]=0xff&stream_stats.sum_latency_usec;
+
+    if( rl >= 2 && 0 != rp[1] )
+    {
+        StreamStatsReset();
+    }
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+void RequestStreamTimed(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_STREAM_TIMED_REPLY_SIZE];
+    uint32_t arrival;
+
+    if( rl != GBPCMD_REQ_STREAM_TIMED_SIZE || GB_STREAM_JITTER != stream_mode )
+    {
+        ReplyError();
+        return;
+    }
+
+    // Timed by when the packet ended, not when the main loop got to it.
+    arrival=serial_rx_end_tick;
+
+    // A whole state and the host's time for it, msec wrapping at 16
+    // bits. The frames play with the spacing of their host times. The
+    // reply is the frames buffered and the playout delay in msec.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1          2         3            4           5    6   7   8   9
+    // Prefix, Time high, Time low, Button high, Button low, HAT, LX, LY, RX, RY
+    // 0       1      2
+    // Prefix, Depth, Delay
+    USB_JoystickReport_Input_t r;
+    memset(&r,0,sizeof(r));
+    r.Button=(((uint16_t)rp[3])<<8)|rp[4];
+    r.HAT=rp[5];
+    r.LX=rp[6];
+    r.LY=rp[7];
+    r.RX=rp[8];
+    r.RY=rp[9];
+    JitterPut(&r,(((uint16_t)rp[1])<<8)|rp[2],arrival);
+
+    reply[0]=GBPCMD_REQ_STREAM_TIMED;
+    reply[1]=jitter_stats.depth;
+    reply[2]=jitter_stats.delay_msec;
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+void RequestJitterStats(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_JITTER_STATS_REPLY_SIZE];
+
+    // A non-zero Clear starts the counts over after this reply. Jitter
+    // is in 1/16 msec, Delay in msec.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1
+    // Prefix, Clear (optional)
+    // 0       1...2   3...4   5...6 7...8    9...10    11...12    13...14 15     16     17
+    // Prefix, Frames, Played, Late, Dropped, Overflow, Underruns, Jitter, Delay, Depth, Max depth
+    reply[0]=GBPCMD_REQ_JITTER_STATS;
+    reply[1]=0xff&(jitter_stats.frames>>8);
+    reply[2]=0xff&jitter_stats.frames;
+    reply[3]=0xff&(jitter_stats.played>>8);
+    reply[4]=0xff&jitter_stats.played;
+    reply[5]=0xff&(jitter_stats.late>>8);
+    reply[6]=0xff&jitter_stats.late;
+    reply[7]=0xff&(jitter_stats.dropped>>8);
+    reply[8]=0xff&jitter_stats.dropped;
+    reply[9]=0xff&(jitter_stats.overflow>>8);
+    reply[10]=0xff&jitter_stats.overflow;
+    reply[11]=0xff&(jitter_stats.underruns>>8);
+    reply[12]=0xff&jitter_stats.underruns;
+    reply[13]=0xff&(jitter_stats.jitter16>>8);
+    reply[14]=0xff&jitter_stats.jitter16;
+    reply[15]=jitter_stats.delay_msec;
+    reply[16]=jitter_stats.depth;
+    reply[17]=jitter_stats.max_depth;
+
+    if( rl >= 2 && 0 != rp[1] )
+    {
+        JitterStatsReset();
+    }
+
+    ReplyPacket(reply,sizeof(reply));
+}
+#endif /* GB_HAVE_STREAM */
+
+#if GB_HAVE_MOTION
+void RequestMotion(uint8_t *rp, uint8_t rl)
+{
+    // Start a motion on a stick, replacing the one running, or stop it.
+    // Ramps run for Duration msec and then give the stick back, or hold
+    // the end until stopped if it is 0. Heading is in 1/65536 of a
+    // turn, 0 up and clockwise, Radius is 0 to 127 from center and
+    // Speed is signed degrees per second, negative anticlockwise. Arcs
+    // run for Duration msec, or are circles until stopped if it is 0.
+    // Request data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1      2
+    // Prefix, Stick, GB_MOTION_NONE
+    // 0       1      2               3   4   5   6   7              8
+    // Prefix, Stick, GB_MOTION_RAMP, X0, Y0, X1, Y1, Duration high, Duration low
+    // 0       1      2               3   4   5   6   7              8
+    // Prefix, Stick, GB_MOTION_EASE, X0, Y0, X1, Y1, Duration high, Duration low
+    // 0       1      2              3             4            5       6           7          8              9
+    // Prefix, Stick, GB_MOTION_ARC, Heading high, Heading low, Radius, Speed high, Speed low, Duration high, Duration low
+    if( rl < 3 || rp[1] >= MOTION_COUNT )
+    {
+        ReplyError();
+        return;
+    }
+
+    uint8_t m=rp[1];
+    switch(rp[2])
+    {
+        case GB_MOTION_NONE:
+            if( rl != 3 )
+            {
+                ReplyError();
+                return;
+            }
+            MotionStop(m);
+            break;
+        case GB_MOTION_RAMP:
+        case GB_MOTION_EASE:
+            if( rl != 9 )
+            {
+                ReplyError();
+                return;
+            }
+            MotionRamp(m,rp[2],rp[3],rp[4],rp[5],rp[6],(((uint16_t)rp[7])<<8)|rp[8]);
+            break;
+        case GB_MOTION_ARC:
+            if( rl != 10 || rp[5] > STICK_MAX-STICK_CENTER )
+            {
+                ReplyError();
+                return;
+            }
+            MotionArc(m,(((uint16_t)rp[3])<<8)|rp[4],rp[5],
+                (int16_t)((((uint16_t)rp[6])<<8)|rp[7]),(((uint16_t)rp[8])<<8)|rp[9]);
+            break;
+        default:
+            ReplyError();
+            return;
+    }
+
+    ReplySuccess();
+}
+#endif /* GB_HAVE_MOTION */
+
+#if GB_HAVE_TURBO
+void RequestTurbo(uint8_t *rp, uint8_t rl)
+{
+    // Press each of Buttons every Period msec, down for Duty percent of
+    // it, Count times or until stopped if 0. A Period of 0 stops them.
+    // Period is at least 2 and Duty 1 to 99, so the button is let go in
+    // each period.
+    // Request data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1             2            3            4           5     6           7
+    // Prefix, Buttons high, Buttons low, Period high, Period low, Duty, Count high, Count low
+    if( rl != 8 )
+    {
+        ReplyError();
+        return;
+    }
+
+    uint16_t buttons=(((uint16_t)rp[1])<<8)|rp[2];
+    uint16_t period=(((uint16_t)rp[3])<<8)|rp[4];
+    uint8_t duty=rp[5];
+    uint16_t count=(((uint16_t)rp[6])<<8)|rp[7];
+    if( 0 == period )
+    {
+        TurboStop(buttons);
+    }
+    else
+    {
+        if( period < 2 || duty < 1 || duty > 99 )
+        {
+            ReplyError();
+            return;
+        }
+        TurboStart(buttons,period,duty,count);
+    }
+
+    ReplySuccess();
+}
+#endif /* GB_HAVE_TURBO */
+
+#if GB_HAVE_MACRO
+void RequestMacroWrite(uint8_t *rp, uint8_t rl)
+{
+    // Add elements to the end of the macro in Slot, all of them or, if
+    // there isn't room for all of them, none. GB_MACRO_START in Flags
+    // erases the slot first, with a Count of 0 that just erases it. The
+    // elements are packed like RequestBatch's, a release right after
+    // another element shares its element. Count is at most
+    // GB_MACRO_WRITE_MAX_ELEMENTS. The reply comes before the EEPROM is
+    // written, the macro requests get GBPCMD_REP_BUSY until it is.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1     2      3      4...
+    // Prefix, Slot, Flags, Count, Elements...
+    // Each element is
+    // 0            1           2    3   4   5   6   7          8
+    // Button high, Button low, Hat, LX, LY, RX, RY, MSec high, MSec low
+    if( rl < 4 )
+    {
+        ReplyError();
+        return;
+    }
+
+    uint8_t slot=rp[1];
+    uint8_t flags=rp[2];
+    uint8_t count=rp[3];
+    if( slot >= MACRO_SLOTS || count > GB_MACRO_WRITE_MAX_ELEMENTS
+        || (rl-4) != ((uint16_t)count)*GB_BATCH_ELEMENT_SIZE )
+    {
+        ReplyError();
+        return;
+    }
+
+    if( macro_writing )
+    {
+        ReplyBusy();
+        return;
+    }
+
+    // Size the elements before anything is changed.
+    cmdqueue_element_t e;
+    uint16_t size=0;
+    uint8_t n=0;
+    while( n < count )
+    {
+        n+=BatchElement(&e,&(rp[4+n*GB_BATCH_ELEMENT_SIZE]),count-n);
+        size+=CMDQueueElementSize(&e);
+    }
+    uint16_t length=(flags & GB_MACRO_START)?0:MacroLength(slot);
+    if( length+size > MACRO_DATA_SIZE )
+    {
+        ReplyOverflow();
+        return;
+    }
+
+    MacroWriteBegin(slot,(flags & GB_MACRO_START)?true:false);
+    n=0;
+    while( n < count )
+    {
+        n+=BatchElement(&e,&(rp[4+n*GB_BATCH_ELEMENT_SIZE]),count-n);
+        MacroWriteAdd(&e);
+    }
+    MacroWriteEnd();
+
+    ReplySuccess();
+}
+
+void RequestMacroList(uint8_t *rp, uint8_t rl)
+{
+    uint8_t reply[GBPCMD_REQ_MACRO_LIST_REPLY_SIZE];
+
+    if( macro_writing )
+    {
+        ReplyBusy();
+        return;
+    }
+
+    // The slots and how full each is.
+    // Request and reply data is MSB-first AKA Network Byte Order AKA Big-Endian
+    // 0       1      2                3
+    // Prefix, Slots, Slot bytes high, Slot bytes low, then for each slot
+    // 0               1              2           3
+    // Elements high,  Elements low,  Bytes high, Bytes low
+    reply[0]=GBPCMD_REQ_MACRO_LIST;
+    reply[1]=MACRO_SLOTS;
+    reply[2]=0xff&(MACRO_DATA_SIZE>>8);
+    reply[3]=0xff&MACRO_DATA_SIZE;
+    uint8_t slot;
+    for(slot=0;slot<MACRO_SLOTS;slot++)
+    {
+        uint16_t count=MacroCount(slot);
+        uint16_t length=MacroLength(slot);
+        reply[4+slot*4]=0xff&(count>>8);
+        reply[5+slot*4]=0xff&count;
+        reply[6+slot*4]=0xff&(length>>8);
+        reply[7+slot*4]=0xff&length;
+    }
+
+    ReplyPacket(reply,sizeof(reply));
+}
+
+void RequestMacroPlay(uint8_t *rp, uint8_t rl)
+{
+    // Play the macro in Slot after the current element, ahead of the
+    // queue, or stop the playing one with GB_MACRO_STOP.
+    // 0       1
+    // Prefix, Slot
+    if( rl != 2 )
+    {
+        ReplyError();
+        return;
+    }
+
+    uint8_t slot=rp[1];
+    if( GB_MACRO_STOP == slot )
+    {
+        MacroStop();
+    }
+    else if( macro_writing )
+    {
+        ReplyBusy();
+        return;
+    }
+    else if( slot >= MACRO_SLOTS || ! MacroPlay(slot) )
+    {
+        ReplyError();
+        return;
+    }
+
+    ReplySuccess();
+}
+#endif /* GB_HAVE_MACRO */
+
+void RequestSetCredits(uint8_t *rp, uint8_t rl)
+{
+    // When on, every v2 reply ends with the free queue bytes, at most
+    // 255, and the free serial input bytes so the host can send only what
+    // fits. Elements are packed to different sizes so size them by their
+    // packed bytes, not by count.
+    // 0       1
+    // Prefix, On
+    if( rl != 2 || rp[1] > 1 )
+    {
+        ReplyError();
+        return;
+    }
+
+    // This reply is still in the old format.
+    ReplySuccess();
+    reply_credits=rp[1];
+}
+
+void RequestSequence(uint8_t *rp, uint8_t rl)
+{
+    // The reply to the wrapped request is prefixed with the same
+    // GBPCMD_REQ_SEQUENCE and sequence number so the host can match it
+    // to the request with several in flight.
+    // 0       1         2
+    // Prefix, Sequence, Request...
+    if( rl < 3 || GBPCMD_REQ_SEQUENCE == rp[2] )
+    {
+        ReplyError();
+        return;
+    }
+
+    ReplySequenceBegin(rp[1]);
+    ProcessRequest(&(rp[2]),rl-2);
+    ReplySequenceEnd();
+}
+
+recent_request_t *RecentRequestFind(uint16_t id)
+{
+    uint8_t i;
+    for(i=0;i<RECENT_REQUEST_COUNT;i++)
+    {
+        if( recent_requests[i].reply_length > 0 && id == recent_requests[i].id )
+        {
+            return &(recent_requests[i]);
+        }
+    }
+    return NULL;
+}
+
+void RequestOnce(uint8_t *rp, uint8_t rl)
+{
+    // The host picks a new id for each request and keeps it when it
+    // sends the request again after a lost reply. A request with an id
+    // that was seen recently gets the reply it got the first time and
+    // isn't run again, so a press isn't queued twice.
+    // 0       1        2       3
+    // Prefix, ID high, ID low, Request...
+    if( rl < 4 || GBPCMD_REQ_ONCE == rp[3] || GBPCMD_REQ_SEQUENCE == rp[3] )
+    {
+        ReplyError();
+        return;
+    }
+
+    uint16_t id=(((uint16_t)rp[1])<<8) | rp[2];
+
+    recent_request_t *rrp=RecentRequestFind(id);
+    if( rrp )
+    {
+        ReplyPacket(rrp->reply,rrp->reply_length);
+        return;
+    }
+
+    rrp=&(recent_requests[recent_request_next]);
+    recent_request_next=(recent_request_next+1)%RECENT_REQUEST_COUNT;
+    rrp->id=id;
+    rrp->reply_length=0;
+
+    ReplyCaptureBegin(rrp->reply,RECENT_REPLY_SIZE);
+    ProcessRequest(&(rp[3]),rl-3);
+    rrp->reply_length=ReplyCaptureEnd();
+}
+
 void ProcessRequest(uint8_t *rp, uint8_t rl)
 {
     if( rl < 1 )
@@ -546,5 +1463,93 @@ void ProcessRequest(uint8_t *rp, uint8_t rl)
         case GBPCMD_REQ_REPORT_PENDING:
             RequestReportPending(rp,rl);
             break;
+        case GBPCMD_REQ_SERIAL_ERRORS:
+            RequestSerialErrors(rp,rl);
+            break;
+        case GBPCMD_REQ_SET_BAUD:
+            RequestSetBaud(rp,rl);
+            break;
+        case GBPCMD_REQ_SET_CHECKSUM:
+            RequestSetChecksum(rp,rl);
+            break;
+        case GBPCMD_REQ_SEQUENCE:
+            RequestSequence(rp,rl);
+            break;
+        case GBPCMD_REQ_ONCE:
+            RequestOnce(rp,rl);
+            break;
+        case GBPCMD_REQ_BATCH:
+            RequestBatch(rp,rl);
+            break;
+        case GBPCMD_REQ_SET_CREDITS:
+            RequestSetCredits(rp,rl);
+            break;
+        case GBPCMD_REQ_CAPACITY:
+            RequestCapacity(rp,rl);
+            break;
+        case GBPCMD_REQ_QUEUE_FREE:
+            RequestQueueFree(rp,rl);
+            break;
+#if GB_HAVE_CHANNELS
+        case GBPCMD_REQ_CHANNEL:
+            RequestChannel(rp,rl);
+            break;
+#endif
+        case GBPCMD_REQ_AT:
+            RequestAt(rp,rl);
+            break;
+        case GBPCMD_REQ_TIME:
+            RequestTime(rp,rl);
+            break;
+        case GBPCMD_REQ_SET_TICK:
+            RequestSetTick(rp,rl);
+            break;
+        case GBPCMD_REQ_SET_UNITS:
+            RequestSetUnits(rp,rl);
+            break;
+        case GBPCMD_REQ_SET_REPORT_MODE:
+            RequestSetReportMode(rp,rl);
+            break;
+        case GBPCMD_REQ_REPORT_STATS:
+            RequestReportStats(rp,rl);
+            break;
+#if GB_HAVE_STREAM
+        case GBPCMD_REQ_STREAM_MODE:
+            RequestStreamMode(rp,rl);
+            break;
+        case GBPCMD_REQ_STREAM:
+            RequestStream(rp,rl);
+            break;
+        case GBPCMD_REQ_STREAM_STATS:
+            RequestStreamStats(rp,rl);
+            break;
+        case GBPCMD_REQ_STREAM_TIMED:
+            RequestStreamTimed(rp,rl);
+            break;
+        case GBPCMD_REQ_JITTER_STATS:
+            RequestJitterStats(rp,rl);
+            break;
+#endif
+#if GB_HAVE_MOTION
+        case GBPCMD_REQ_MOTION:
+            RequestMotion(rp,rl);
+            break;
+#endif
+#if GB_HAVE_TURBO
+        case GBPCMD_REQ_TURBO:
+            RequestTurbo(rp,rl);
+            break;
+#endif
+#if GB_HAVE_MACRO
+        case GBPCMD_REQ_MACRO_WRITE:
+            RequestMacroWrite(rp,rl);
+            break;
+        case GBPCMD_REQ_MACRO_LIST:
+            RequestMacroList(rp,rl);
+            break;
+        case GBPCMD_REQ_MACRO_PLAY:
+            RequestMacroPlay(rp,rl);
+            break;
+#endif
     }
 }
@@ -0,0 +1,349 @@
+/*
+Copyright 2021 by angry-kitten
+Streaming for gamebot-serial.
+*/
+
+#include <LUFA/Drivers/USB/USB.h>
+#include <LUFA/Platform/Platform.h>
+
+#include "gamebotserial.h"
+#include "stream.h"
+#include "timebase.h"
+
+#if GB_HAVE_STREAM
+
+uint8_t stream_mode=GB_STREAM_OFF;
+stream_stats_t stream_stats;
+USB_JoystickReport_Input_t stream_mailbox; // the newest state
+bool stream_fresh=false; // the mailbox hasn't been built into a report
+bool stream_waiting=false; // the newest state hasn't reached the host
+uint8_t stream_sequence=0; // the host's number for the newest state
+uint32_t stream_rx_usec=0; // TimerMicros() when its packet ended
+uint16_t stream_report_sequence=0; // report_sequence of the report carrying it
+
+// The jitter buffer.
+jitter_stats_t jitter_stats;
+jitter_frame_t jitter_ring[JITTER_QUEUE_SIZE];
+uint8_t jitter_head=0; // incremented as frames added
+uint8_t jitter_tail=0; // incremented as frames play
+bool jitter_started=false; // a frame has come since the reset
+uint16_t jitter_last_msec=0; // host time of the last frame
+uint32_t jitter_host_tick=0; // and unwrapped
+uint16_t jitter_interval=0; // host msec between the last two frames, 0 if unknown
+int32_t jitter_offset=0; // playout tick less host time
+int32_t jitter_last_transit=0; // arrival tick less host time, last frame
+int32_t jitter_base=0; // the smallest transit, last window
+int32_t jitter_window_min=0; // the smallest transit in this window
+int32_t jitter_window_max=0; // and the largest
+int32_t jitter_last_window_max=0; // the largest in the last window
+uint8_t jitter_window_count=0;
+uint32_t jitter_played_tick=0; // when the last frame played
+bool jitter_dry=true; // no underrun to count until a frame plays
+
+void JitterReset(void)
+{
+    jitter_head=0;
+    jitter_tail=0;
+    jitter_started=false;
+    jitter_interval=0;
+    jitter_window_count=0;
+    jitter_dry=true;
+    JitterStatsReset();
+    jitter_stats.delay_msec=JITTER_DELAY_MIN;
+    jitter_stats.depth=0;
+}
+
+// Choose GB_STREAM_OFF, GB_STREAM_LATEST or GB_STREAM_JITTER. Starting
+// from off holds the state at pr until the host sends one. Returns false
+// if the mode isn't known.
+bool StreamSetMode(uint8_t mode, USB_JoystickReport_Input_t *pr)
+{
+    if( mode > GB_STREAM_JITTER )
+    {
+        return false;
+    }
+    if( GB_STREAM_OFF == stream_mode && GB_STREAM_OFF != mode )
+    {
+        stream_mailbox=*pr;
+        stream_fresh=false;
+        stream_waiting=false;
+        StreamStatsReset();
+    }
+    if( GB_STREAM_JITTER == mode && GB_STREAM_JITTER != stream_mode )
+    {
+        JitterReset();
+    }
+    stream_mode=mode;
+
+    return true;
+}
+
+// Put a new state in the mailbox, over any the host hasn't seen.
+void StreamPut(USB_JoystickReport_Input_t *pr, uint8_t sequence, uint32_t rx_usec)
+{
+    if( stream_waiting )
+    {
+        stream_stats.replaced++;
+    }
+    stream_stats.updates++;
+    stream_mailbox=*pr;
+    stream_sequence=sequence;
+    stream_rx_usec=rx_usec;
+    stream_fresh=true;
+    stream_waiting=true;
+}
+
+// Copy the newest state to pr. Returns true if it is new since the last
+// time, then it must go out as a new report even if nothing changed.
+bool StreamTake(USB_JoystickReport_Input_t *pr)
+{
+    bool fresh=stream_fresh;
+
+    *pr=stream_mailbox;
+    stream_fresh=false;
+
+    return fresh;
+}
+
+// The newest state went out in the report numbered report_sequence.
+void StreamReported(uint16_t report_sequence)
+{
+    stream_report_sequence=report_sequence;
+}
+
+// The host took the report numbered report_sequence for the first time.
+void StreamDelivered(uint16_t report_sequence)
+{
+    if( ! stream_waiting || report_sequence != stream_report_sequence || stream_fresh )
+    {
+        return;
+    }
+    stream_waiting=false;
+
+    uint32_t latency=TimerMicros()-stream_rx_usec;
+    if( latency > 0xffff )
+    {
+        latency=0xffff;
+    }
+    stream_stats.delivered++;
+    stream_stats.last_sequence=stream_sequence;
+    stream_stats.last_latency_usec=latency;
+    if( latency > stream_stats.max_latency_usec )
+    {
+        stream_stats.max_latency_usec=latency;
+    }
+    stream_stats.sum_latency_usec+=latency;
+}
+
+void StreamStatsReset(void)
+{
+    memset(&stream_stats,0,sizeof(stream_stats));
+}
+
+// Buffer the frame at pr, from host time host_msec, that arrived at
+// arrival_tick, to play at its host time plus the playout offset.
+void JitterPut(USB_JoystickReport_Input_t *pr, uint16_t host_msec, uint32_t arrival_tick)
+{
+    int32_t transit;
+
+    jitter_stats.frames++;
+    if( jitter_started )
+    {
+        uint16_t back=jitter_last_msec-host_msec;
+        if( back > 0 && back <= JITTER_REORDER_MSEC )
+        {
+            // Older than the last frame, it came out of order.
+            jitter_stats.dropped++;
+            return;
+        }
+        if( (uint16_t)(host_msec-jitter_last_msec) > JITTER_REORDER_MSEC )
+        {
+            // A gap longer than any reordering, the host paused or its
+            // clock jumped. Start again from this frame. Frames still
+            // buffered keep their ticks and this one won't play before
+            // them.
+            jitter_started=false;
+        }
+    }
+    if( ! jitter_started )
+    {
+        jitter_started=true;
+        jitter_host_tick=host_msec;
+        transit=(int32_t)(arrival_tick-jitter_host_tick);
+        jitter_offset=transit+JITTER_DELAY_MIN;
+        jitter_base=transit;
+        jitter_window_min=transit;
+        jitter_window_max=transit;
+        jitter_last_window_max=transit;
+    }
+    else
+    {
+        uint16_t step=host_msec-jitter_last_msec;
+        if( step > 0 )
+        {
+            jitter_interval=step;
+        }
+        jitter_host_tick+=step;
+        transit=(int32_t)(arrival_tick-jitter_host_tick);
+
+        // Smoothed like RTP's interarrival jitter, j+=(|d|-j)/16, kept
+        // in 1/16 msec.
+        int32_t d=transit-jitter_last_transit;
+        if( d < 0 )
+        {
+            d=-d;
+        }
+        if( d > JITTER_DELAY_MAX )
+        {
+            d=JITTER_DELAY_MAX;
+        }
+        jitter_stats.jitter16+=d-((jitter_stats.jitter16+8)>>4);
+    }
+    jitter_last_msec=host_msec;
+    jitter_last_transit=transit;
+
+    if( transit < jitter_window_min )
+    {
+        jitter_window_min=transit;
+    }
+    if( transit > jitter_window_max )
+    {
+        jitter_window_max=transit;
+    }
+    if( transit < jitter_base )
+    {
+        jitter_base=transit;
+    }
+
+    if( transit+JITTER_DELAY_MIN > jitter_offset )
+    {
+        // It came after its playout tick. Move the playout back enough
+        // for it.
+        jitter_stats.late++;
+        jitter_offset=transit+JITTER_DELAY_MIN;
+    }
+    if( jitter_offset-jitter_base > JITTER_DELAY_MAX )
+    {
+        // Never more than the most delay allowed, the host's clock may
+        // run slow.
+        jitter_offset=jitter_base+JITTER_DELAY_MAX;
+    }
+
+    jitter_window_count++;
+    if( jitter_window_count >= JITTER_WINDOW )
+    {
+        // Shrink a msec if the latest of the last two windows would
+        // still have been on time. The smallest transit of the window
+        // is the base for the next, so drift between the clocks is
+        // followed.
+        int32_t latest=jitter_window_max;
+        if( jitter_last_window_max > latest )
+        {
+            latest=jitter_last_window_max;
+        }
+        if( latest+JITTER_DELAY_MIN < jitter_offset )
+        {
+            jitter_offset--;
+        }
+        jitter_last_window_max=jitter_window_max;
+        jitter_base=jitter_window_min;
+        jitter_window_min=transit;
+        jitter_window_max=transit;
+        jitter_window_count=0;
+    }
+
+    int32_t delay=jitter_offset-jitter_base;
+    if( delay < 0 )
+    {
+        delay=0;
+    }
+    jitter_stats.delay_msec=delay;
+
+    uint32_t play=jitter_host_tick+jitter_offset;
+    if( (int32_t)(play-arrival_tick) < 0 )
+    {
+        // Later than even the most delay.
+        jitter_stats.dropped++;
+        return;
+    }
+    if( JITTER_QUEUE_SIZE == (uint8_t)(jitter_head-jitter_tail) )
+    {
+        jitter_stats.overflow++;
+        return;
+    }
+    if( jitter_head != jitter_tail )
+    {
+        // Never before the frame ahead of it.
+        uint32_t ahead=jitter_ring[(jitter_head-1)&JITTER_QUEUE_MASK].play_tick;
+        if( (int32_t)(play-ahead) < 0 )
+        {
+            play=ahead;
+        }
+    }
+
+    jitter_frame_t *pf=&(jitter_ring[jitter_head&JITTER_QUEUE_MASK]);
+    pf->r=*pr;
+    pf->play_tick=play;
+    pf->sequence=0xff&host_msec;
+    jitter_head++;
+
+    jitter_stats.depth=jitter_head-jitter_tail;
+    if( jitter_stats.depth > jitter_stats.max_depth )
+    {
+        jitter_stats.max_depth=jitter_stats.depth;
+    }
+}
+
+// Play the jitter buffer's frames into the mailbox as they come due.
+void Stream_Task(void)
+{
+    if( GB_STREAM_JITTER != stream_mode )
+    {
+        return;
+    }
+
+    uint32_t now=TickNow();
+    while( jitter_head != jitter_tail )
+    {
+        jitter_frame_t *pf=&(jitter_ring[jitter_tail&JITTER_QUEUE_MASK]);
+        if( (int32_t)(now-pf->play_tick) < 0 )
+        {
+            break;
+        }
+        jitter_tail++;
+        if( jitter_head != jitter_tail
+            && (int32_t)(now-jitter_ring[jitter_tail&JITTER_QUEUE_MASK].play_tick) >= 0 )
+        {
+            // The next one is due too, this one is too late to be seen.
+            jitter_stats.dropped++;
+            continue;
+        }
+        StreamPut(&(pf->r),pf->sequence,TimerMicros());
+        jitter_stats.played++;
+        jitter_played_tick=now;
+        jitter_dry=false;
+    }
+    jitter_stats.depth=jitter_head-jitter_tail;
+
+    if( ! jitter_dry && jitter_head == jitter_tail && jitter_interval > 0
+        && (int32_t)(now-jitter_played_tick) > jitter_interval )
+    {
+        // The next frame should have played by now. The end of a stream
+        // counts as one too.
+        jitter_stats.underruns++;
+        jitter_dry=true;
+    }
+}
+
+// Start the counts over, the delay and depth are kept.
+void JitterStatsReset(void)
+{
+    uint8_t delay=jitter_stats.delay_msec;
+    uint8_t depth=jitter_stats.depth;
+
+    memset(&jitter_stats,0,sizeof(jitter_stats));
+    jitter_stats.delay_msec=delay;
+    jitter_stats.depth=depth;
+}
+
+#endif /* GB_HAVE_STREAM */
@@ -0,0 +1,85 @@
+/*
+Copyright 2021 by angry-kitten
+Streaming for gamebot-serial.
+*/
+
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include "Joystick.h"
+#include "cmdqueue.h"
+
+// While streaming the host sends whole states into a one slot mailbox
+// that takes the place of the command queue's report. A newer state
+// replaces one the host hasn't seen yet, nothing waits behind a
+// duration. The channels are still merged over it.
+//
+// In GB_STREAM_JITTER the states are timed frames instead. Each is
+// stamped with interrupt_count when it arrives and held in a jitter
+// buffer until its playout tick, its host time plus one playout offset,
+// so frames come out with the spacing the host gave them. The offset
+// grows at once when a frame would be late and shrinks a msec a window
+// while the latest arrivals leave room, so the playout delay follows the
+// arrival jitter with few steps.
+#if RAM_SIZE >= 8192
+#define JITTER_QUEUE_SIZE       (32)
+#elif RAM_SIZE >= 2560
+#define JITTER_QUEUE_SIZE       (16)
+#else
+#define JITTER_QUEUE_SIZE       (4)
+#endif
+#define JITTER_QUEUE_MASK       (JITTER_QUEUE_SIZE-1)
+#if (JITTER_QUEUE_SIZE & JITTER_QUEUE_MASK) || (JITTER_QUEUE_SIZE > 128)
+#error JITTER_QUEUE_SIZE must be a power of two no larger than 128
+#endif
+
+#define JITTER_DELAY_MIN        (1) // msec
+#define JITTER_DELAY_MAX        (100) // msec
+#define JITTER_WINDOW           (64) // frames per window, the delay may shrink a msec each
+#define JITTER_REORDER_MSEC     (4*JITTER_DELAY_MAX) // older frames than this are a clock jump, not out of order
+
+typedef struct jitter_frame_t {
+    USB_JoystickReport_Input_t r;
+    uint32_t play_tick; // interrupt_count to send it at
+    uint8_t sequence; // low byte of its host time
+} jitter_frame_t;
+
+typedef struct jitter_stats_t {
+    uint16_t frames; // timed frames received
+    uint16_t played; // sent at their playout tick
+    uint16_t late; // came after their playout tick, the delay grew
+    uint16_t dropped; // too late to play or passed over by a later one
+    uint16_t overflow; // dropped, the buffer was full
+    uint16_t underruns; // the buffer ran dry before the next frame was due
+    uint16_t jitter16; // arrival jitter in 1/16 msec
+    uint8_t delay_msec; // the playout delay over the smallest transit
+    uint8_t depth; // frames buffered
+    uint8_t max_depth; // and the most
+} jitter_stats_t;
+
+typedef struct stream_stats_t {
+    uint16_t updates; // states put in the mailbox
+    uint16_t delivered; // of those the host got
+    uint16_t replaced; // replaced before the host got them
+    uint8_t last_sequence; // the host's number for the last one delivered
+    uint16_t last_latency_usec; // its packet end to the host taking it
+    uint16_t max_latency_usec; // and the longest
+    uint32_t sum_latency_usec; // and all of them, for the average
+} stream_stats_t;
+
+extern uint8_t stream_mode;
+extern stream_stats_t stream_stats;
+extern jitter_stats_t jitter_stats;
+
+// stream.c
+bool StreamSetMode(uint8_t mode, USB_JoystickReport_Input_t *pr);
+void StreamPut(USB_JoystickReport_Input_t *pr, uint8_t sequence, uint32_t rx_usec);
+bool StreamTake(USB_JoystickReport_Input_t *pr);
+void StreamReported(uint16_t report_sequence);
+void StreamDelivered(uint16_t report_sequence);
+void StreamStatsReset(void);
+void JitterPut(USB_JoystickReport_Input_t *pr, uint16_t host_msec, uint32_t arrival_tick);
+void Stream_Task(void);
+void JitterStatsReset(void);
+
+#endif /* _STREAM_H */
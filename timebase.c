@@ -0,0 +1,205 @@
+/*
+Copyright 2021 by angry-kitten
+Time base for gamebot-serial.
+*/
+
+#include <util/atomic.h>
+
+#include <LUFA/Drivers/USB/USB.h>
+#include <LUFA/Platform/Platform.h>
+
+#include "gamebotserial.h"
+#include "timebase.h"
+
+// The schedule tick, once a msec from Timer1 or from USB frames.
+volatile uint32_t interrupt_count=0;
+volatile uint16_t tick_timer_count=0; // TCNT1 at the last schedule tick
+// Timer1 msec, always from the timer.
+volatile uint32_t timer_msec=0;
+uint8_t tick_source=GB_TICK_TIMER;
+volatile uint8_t sof_missed_msec=SOF_MISSED_MAX; // timer msec since the last frame
+// The drift of the timer against the USB frames.
+volatile uint32_t drift_start_usec=0;
+volatile uint16_t drift_frames=0;
+volatile int16_t drift_ppm=DRIFT_UNKNOWN;
+
+void TimebaseInit(void)
+{
+    // CTC mode with TOP in OCR1A, prescaler 8.
+    TCCR1A=0;
+    OCR1A=TIMER_COUNTS_PER_MSEC-1;
+    TCNT1=0;
+    TIMSK1|=(1 << OCIE1A);
+    TCCR1B=(1 << WGM12) | (1 << CS11);
+}
+
+ISR (TIMER1_COMPA_vect) // timer1 compare A interrupt, once a msec
+{
+    timer_msec++;
+
+    // While USB frames are the tick this only notices them stopping.
+    bool frames=TickFromFrames();
+    if( sof_missed_msec < SOF_MISSED_MAX )
+    {
+        sof_missed_msec++;
+    }
+    if( ! frames )
+    {
+        interrupt_count++;
+        tick_timer_count=0;
+    }
+
+    LEDTick();
+}
+
+#if !defined(NO_SOF_EVENTS)
+// Fired at the start of every USB frame, once a msec of the host's
+// clock. The Switch polls the IN endpoint once a frame so ticking here
+// lines report changes up with when the host can see them.
+void EVENT_USB_Device_StartOfFrame(void)
+{
+    uint32_t now=TimerMicros();
+
+    if( sof_missed_msec >= SOF_MISSED_MAX )
+    {
+        // Frames are starting again, start measuring again.
+        drift_start_usec=now;
+        drift_frames=0;
+    }
+    else
+    {
+        drift_frames++;
+        if( drift_frames >= DRIFT_FRAMES )
+        {
+            // The microseconds over a million are parts per million.
+            int32_t d=(int32_t)(now-drift_start_usec)-(int32_t)DRIFT_FRAMES*1000;
+            if( d > 32767 )
+            {
+                d=32767;
+            }
+            else if( d < -32767 )
+            {
+                d=-32767;
+            }
+            drift_ppm=d;
+            drift_start_usec=now;
+            drift_frames=0;
+        }
+    }
+    sof_missed_msec=0;
+
+    if( GB_TICK_USB_FRAMES == tick_source )
+    {
+        interrupt_count++;
+        tick_timer_count=TCNT1;
+    }
+}
+#endif
+
+// The schedule tick, read in one piece.
+uint32_t TickNow(void)
+{
+    uint32_t t;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        t=interrupt_count;
+    }
+
+    return t;
+}
+
+// Microseconds of Timer1, free running. Wraps every 71 minutes.
+uint32_t TimerMicros(void)
+{
+    uint32_t ms;
+    uint16_t count;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        ms=timer_msec;
+        count=TCNT1;
+        if( TIFR1 & (1 << OCF1A) )
+        {
+            // The timer wrapped but its interrupt hasn't run yet.
+            ms++;
+            count=TCNT1;
+        }
+    }
+
+    return ms*1000+count/TIMER_COUNTS_PER_USEC;
+}
+
+// The schedule tick in microseconds, interrupt_count times 1000 plus how
+// far the timer has run since the tick. Wraps every 71 minutes, use
+// differences.
+uint32_t ScheduleMicros(void)
+{
+    uint32_t ticks;
+    uint16_t count;
+    uint16_t since;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        ticks=interrupt_count;
+        since=tick_timer_count;
+        count=TCNT1;
+        if( (TIFR1 & (1 << OCF1A)) && ! TickFromFrames() )
+        {
+            // The timer ticked but its interrupt hasn't run yet.
+            ticks++;
+            since=0;
+            count=TCNT1;
+        }
+    }
+
+    uint16_t elapsed=(count >= since)?(count-since):(count+TIMER_COUNTS_PER_MSEC-since);
+    uint16_t usec=elapsed/TIMER_COUNTS_PER_USEC;
+    if( usec > 999 )
+    {
+        // A frame is late, hold at the end of the tick.
+        usec=999;
+    }
+
+    return ticks*1000+usec;
+}
+
+// Choose what times the schedule, GB_TICK_TIMER or GB_TICK_USB_FRAMES.
+// Frames stop while the host isn't polling, then the timer fills in.
+// Returns false if the source isn't supported.
+bool SetTickSource(uint8_t source)
+{
+    if( GB_TICK_TIMER == source )
+    {
+        tick_source=source;
+        return true;
+    }
+#if !defined(NO_SOF_EVENTS)
+    if( GB_TICK_USB_FRAMES == source )
+    {
+        tick_source=source;
+        return true;
+    }
+#endif
+    return false;
+}
+
+// True while USB frames are timing the schedule.
+bool TickFromFrames(void)
+{
+    return GB_TICK_USB_FRAMES == tick_source && sof_missed_msec < SOF_MISSED_MAX;
+}
+
+// How fast Timer1 runs against the host's USB frames in parts per
+// million, or DRIFT_UNKNOWN before a second of frames has been seen.
+int16_t TimerDriftPPM(void)
+{
+    int16_t d;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        d=drift_ppm;
+    }
+
+    return d;
+}
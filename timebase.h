@@ -0,0 +1,41 @@
+/*
+Copyright 2021 by angry-kitten
+Time base for gamebot-serial.
+*/
+
+#ifndef _TIMEBASE_H
+#define _TIMEBASE_H
+
+#include "Joystick.h"
+
+// Timer1 runs in CTC mode so the hardware restarts it every msec, no
+// matter how late the compare interrupt runs. Between interrupts TCNT1
+// is the fraction of the msec.
+#define TIMER_PRESCALE          (8)
+#define TIMER_COUNTS_PER_MSEC   (F_CPU/TIMER_PRESCALE/1000)
+#define TIMER_COUNTS_PER_USEC   (F_CPU/TIMER_PRESCALE/1000000)
+#if TIMER_COUNTS_PER_MSEC > 0xffff || TIMER_COUNTS_PER_USEC < 1
+#error F_CPU does not suit the Timer1 prescaler
+#endif
+
+// The timer takes over the schedule after this many msec without a USB
+// frame.
+#define SOF_MISSED_MAX          (2)
+
+// The timer is measured against this many USB frames, a second of the
+// host's clock, for the drift.
+#define DRIFT_FRAMES            (1000)
+#define DRIFT_UNKNOWN           (-32768)
+
+extern uint8_t tick_source;
+
+// timebase.c
+void TimebaseInit(void);
+uint32_t TickNow(void);
+uint32_t TimerMicros(void);
+uint32_t ScheduleMicros(void);
+bool SetTickSource(uint8_t source);
+bool TickFromFrames(void);
+int16_t TimerDriftPPM(void);
+
+#endif /* _TIMEBASE_H */
@@ -0,0 +1,130 @@
+/*
+Copyright 2021 by angry-kitten
+Turbo buttons for gamebot-serial.
+*/
+
+#include <LUFA/Drivers/USB/USB.h>
+#include <LUFA/Platform/Platform.h>
+
+#include "gamebotserial.h"
+#include "turbo.h"
+#include "timebase.h"
+
+#if GB_HAVE_TURBO
+
+turbo_t turbos[TURBO_COUNT];
+uint16_t turbo_running=0;
+uint16_t turbo_pressed=0;
+uint16_t turbo_last_tick=0; // low bits of interrupt_count last worked out
+
+void TurboReset(void)
+{
+    TurboStop(0xffff);
+}
+
+// Start pressing each of buttons every period_msec, down for
+// duty_percent of it, count times or until stopped if 0. Buttons
+// started together stay in step. The period must be at least 2 msec.
+void TurboStart(uint16_t buttons, uint16_t period_msec, uint8_t duty_percent, uint16_t count)
+{
+    uint16_t now=TickNow();
+    uint16_t on=((uint32_t)period_msec*duty_percent)/100;
+    if( 0 == on )
+    {
+        // Always down for at least a tick.
+        on=1;
+    }
+    if( on >= period_msec )
+    {
+        // And up for at least one, or it never lets go.
+        on=period_msec-1;
+    }
+
+    uint8_t b;
+    for(b=0;b<TURBO_COUNT;b++)
+    {
+        if( buttons & (1U << b) )
+        {
+            turbo_t *pt=&(turbos[b]);
+            pt->period_msec=period_msec;
+            pt->on_msec=on;
+            pt->count=count;
+            pt->start_tick=now;
+        }
+    }
+    turbo_running|=buttons;
+    turbo_pressed|=buttons;
+    turbo_last_tick=now;
+}
+
+void TurboStop(uint16_t buttons)
+{
+    uint8_t b;
+    for(b=0;b<TURBO_COUNT;b++)
+    {
+        if( buttons & (1U << b) )
+        {
+            turbos[b].period_msec=0;
+        }
+    }
+    turbo_running&=~buttons;
+    turbo_pressed&=~buttons;
+}
+
+// Work out which buttons are down once a tick.
+void Turbo_Task(void)
+{
+    if( 0 == turbo_running )
+    {
+        return;
+    }
+    uint16_t now=TickNow();
+    if( now == turbo_last_tick )
+    {
+        return;
+    }
+    turbo_last_tick=now;
+
+    uint16_t pressed=0;
+    uint8_t b;
+    for(b=0;b<TURBO_COUNT;b++)
+    {
+        turbo_t *pt=&(turbos[b]);
+        if( 0 == pt->period_msec )
+        {
+            continue;
+        }
+        uint16_t elapsed=now-pt->start_tick;
+        if( elapsed >= pt->period_msec )
+        {
+            // The next press. Stay on the period even if ticks were
+            // missed, a press is used up for each period that passed.
+            if( pt->count > 0 )
+            {
+                uint16_t presses=elapsed/pt->period_msec;
+                if( presses >= pt->count )
+                {
+                    pt->count=0;
+                    pt->period_msec=0;
+                    turbo_running&=~(1U << b);
+                    continue;
+                }
+                pt->count-=presses;
+            }
+            elapsed%=pt->period_msec;
+            pt->start_tick=now-elapsed;
+        }
+        if( elapsed < pt->on_msec )
+        {
+            pressed|=(1U << b);
+        }
+    }
+    turbo_pressed=pressed;
+}
+
+void TurboMerge(USB_JoystickReport_Input_t *pr)
+{
+    pr->Button=(pr->Button&~turbo_running)|turbo_pressed;
+}
+
+#endif /* GB_HAVE_TURBO */
@@ -0,0 +1,35 @@
+/*
+Copyright 2021 by angry-kitten
+Turbo buttons for gamebot-serial.
+*/
+
+#ifndef _TURBO_H
+#define _TURBO_H
+
+#include "Joystick.h"
+
+// A turbo entry per JoystickButtons_t bit presses that button over and
+// over, on for part of each period, for a count of presses or until
+// stopped. It runs alongside the queue, the bit is taken over in the
+// report while the entry is running.
+#define TURBO_COUNT             (16)
+
+typedef struct turbo_t {
+    uint16_t period_msec; // 0 when stopped
+    uint16_t on_msec; // pressed this much of each period
+    uint16_t count; // presses left, 0 for no end
+    uint16_t start_tick; // low bits of interrupt_count at this press
+} turbo_t;
+
+extern turbo_t turbos[TURBO_COUNT];
+extern uint16_t turbo_running; // buttons with a running entry
+extern uint16_t turbo_pressed; // and of those the ones down now
+
+// turbo.c
+void TurboReset(void);
+void TurboStart(uint16_t buttons, uint16_t period_msec, uint8_t duty_percent, uint16_t count);
+void TurboStop(uint16_t buttons);
+void Turbo_Task(void);
+void TurboMerge(USB_JoystickReport_Input_t *pr);
+
+#endif /* _TURBO_H */